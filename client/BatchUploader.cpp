@@ -0,0 +1,174 @@
+#include <BatchUploader.hpp>
+#include <FrameDedup.hpp>
+#include <Requester.hpp>
+#include <json/json.h>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+using namespace std;
+
+namespace VideoMatch {
+
+namespace {
+
+struct Job
+{
+    string name;
+    vector<uint64_t> frames;
+    /* empty if all frames are sent */
+    vector<uint32_t> positions;
+    size_t hashed;
+};
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* code 0 of the server's reply */
+bool reply_ok(const string& reply)
+{
+    Json::Reader reader;
+    Json::Value v;
+    return reader.parse(reply, v) && v.isObject() && v["code"].asInt() == 0;
+}
+
+} //end of namespace
+
+BatchUploader::BatchUploader(const string& url, FrameHasher& hasher, int inflight, int dedup_bits)
+    : url_(url), hasher_(hasher), inflight_(inflight > 0 ? inflight : 1), dedup_bits_(dedup_bits)
+{
+}
+
+int BatchUploader::ListVideos(const string& root, vector<Video>& videos)
+{
+    struct dirent **filelist;
+    int fnum = scandir(root.c_str(), &filelist, 0, alphasort);
+    if (fnum < 0)
+        return -1;
+    for(int i = 0; i < fnum; i++) {
+        string name = filelist[i]->d_name;
+        string dir = root + "/" + name;
+        struct stat st;
+        if (name[0] != '.' && stat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+            videos.push_back(Video{name, dir});
+        free(filelist[i]);
+    }
+    free(filelist);
+    return 0;
+}
+
+int BatchUploader::ReadManifest(const string& file, vector<Video>& videos)
+{
+    ifstream in(file);
+    if (!in)
+        return -1;
+    string line;
+    while(getline(in, line)) {
+        istringstream fields(line);
+        string first, second;
+        if (!(fields >> first) || first[0] == '#')
+            continue;
+        if (fields >> second) {
+            videos.push_back(Video{first, second});
+        } else {
+            while(first.size() > 1 && first.back() == '/')
+                first.pop_back();
+            size_t slash = first.rfind('/');
+            videos.push_back(Video{slash == string::npos ? first : first.substr(slash + 1), first});
+        }
+    }
+    return 0;
+}
+
+int BatchUploader::Run(const vector<Video>& videos, Stat& stat)
+{
+    deque<Job> queue;
+    bool hashed_all = false;
+    mutex m;
+    condition_variable cv_job, cv_space;
+    stat.videos = stat.failed = 0;
+    stat.frames = stat.sent_frames = 0;
+    double start = now_seconds();
+
+    vector<thread> senders;
+    for(int t = 0; t < inflight_; t++) {
+        senders.push_back(thread([&]() {
+            Requester requester(false);
+            requester.InitUrl(url_);
+            while(true) {
+                Job job;
+                {
+                    unique_lock<mutex> lock(m);
+                    cv_job.wait(lock, [&]() { return !queue.empty() || hashed_all; });
+                    if (queue.empty())
+                        return;
+                    job = std::move(queue.front());
+                    queue.pop_front();
+                }
+                cv_space.notify_one();
+
+                string reply;
+                bool ok = requester.Add(job.name, job.frames, reply,
+                        job.positions.empty() ? nullptr : &job.positions) == 0 && reply_ok(reply);
+                lock_guard<mutex> lock(m);
+                printf("%s %d %s\n", job.name.c_str(), (int)job.hashed, ok ? "ok" : "failed");
+                if (!ok)
+                    fprintf(stderr, "Add %s failed: %s\n", job.name.c_str(), reply.c_str());
+                stat.videos++;
+                stat.failed += !ok;
+                stat.frames += job.hashed;
+                stat.sent_frames += job.frames.size();
+            }
+        }));
+    }
+
+    for(const auto& video : videos) {
+        Job job;
+        job.name = video.name;
+        if (hasher_.HashDir(video.dir, job.frames) < 0) {
+            fprintf(stderr, "Can not read %s\n", video.dir.c_str());
+            lock_guard<mutex> lock(m);
+            printf("%s 0 failed\n", video.name.c_str());
+            stat.videos++;
+            stat.failed++;
+            continue;
+        }
+        job.hashed = job.frames.size();
+        if (dedup_bits_ >= 0) {
+            vector<uint64_t> kept;
+            FrameDedup::Collapse(job.frames, dedup_bits_, kept, job.positions);
+            job.frames.swap(kept);
+        }
+        unique_lock<mutex> lock(m);
+        cv_space.wait(lock, [&]() { return (int)queue.size() < inflight_; });
+        queue.push_back(std::move(job));
+        lock.unlock();
+        cv_job.notify_one();
+    }
+    {
+        lock_guard<mutex> lock(m);
+        hashed_all = true;
+    }
+    cv_job.notify_all();
+    for(auto& t : senders)
+        t.join();
+
+    stat.seconds = now_seconds() - start;
+    return stat.failed ? -1 : 0;
+}
+
+
+}
+
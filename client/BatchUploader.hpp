@@ -0,0 +1,59 @@
+#ifndef _BATCHUPLOADER_HPP_
+#define _BATCHUPLOADER_HPP_
+#include <FrameHasher.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace VideoMatch {
+
+/* Adds many videos from one process.
+
+   Videos are hashed one after another by the FrameHasher, each already on
+   all its threads, while 'inflight' senders upload the ones hashed
+   before, so hashing video N + 1 overlaps uploading video N. Each sender
+   keeps its own Requester, so its connection to the server is kept alive
+   from one video to the next. At most 'inflight' hashed videos wait for a
+   sender, hashing blocks when they are all busy. */
+class BatchUploader
+{
+    std::string url_;
+    FrameHasher& hasher_;
+    int inflight_;
+    int dedup_bits_;
+public:
+    struct Video
+    {
+        std::string name;
+        std::string dir;
+    };
+
+    struct Stat
+    {
+        int videos;
+        int failed;
+        long frames;
+        /* after dedup */
+        long sent_frames;
+        double seconds;
+    };
+
+    /* 'dedup_bits' >= 0 sends the keyframes of FrameDedup only */
+    BatchUploader(const std::string& url, FrameHasher& hasher, int inflight = 4, int dedup_bits = -1);
+
+    /* subdirectories of 'root', named by their names, in name order */
+    static int ListVideos(const std::string& root, std::vector<Video>& videos);
+    /* lines of "<name> <dir>", or "<dir>" named by its last component,
+       empty lines and lines starting with '#' are skipped */
+    static int ReadManifest(const std::string& file, std::vector<Video>& videos);
+
+    /* a line on stdout per video, "<name> <frames> ok|failed",
+       return -1 if any failed */
+    int Run(const std::vector<Video>& videos, Stat& stat);
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,39 @@
+#ifndef _FRAMEDEDUP_HPP_
+#define _FRAMEDEDUP_HPP_
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+namespace VideoMatch {
+
+/* Collapses runs of near identical frames, as a still shot gives, before
+   they are sent.
+
+   A run is the frames within 'max_bits' of its first frame, the keyframe,
+   only keyframes are kept, with their positions among the original frames.
+   Comparing with the keyframe, not the frame before, keeps a slow pan from
+   collapsing into one run. 0 bits drops exact repeats only.
+   Header only, the server's eval measures the matching quality with it. */
+class FrameDedup
+{
+public:
+    template<typename Position>
+    static void Collapse(const std::vector<uint64_t>& frames, int max_bits,
+            std::vector<uint64_t>& kept, std::vector<Position>& positions)
+    {
+        kept.clear();
+        positions.clear();
+        for(size_t i = 0; i < frames.size(); i++) {
+            if (!kept.empty() && __builtin_popcountll(frames[i] ^ kept.back()) <= max_bits)
+                continue;
+            kept.push_back(frames[i]);
+            positions.push_back((Position)i);
+        }
+    }
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,158 @@
+#include <FrameHasher.hpp>
+#include <HashCache.hpp>
+#include <ImageProcessor.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace VideoMatch {
+
+/* let the kernel read the file into page cache in the background */
+static void read_ahead(const string& file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+FrameHasher::FrameHasher(int threads, int prefetch, HashMode mode)
+    : mode_(mode), cache_(nullptr)
+{
+    threads_ = threads > 0 ? threads : max((int)thread::hardware_concurrency(), 1);
+    prefetch_ = prefetch > 0 ? prefetch : 4 * threads_;
+}
+
+int FrameHasher::ListFrames(const string& dir, vector<string>& files)
+{
+    struct dirent **filelist;
+    int fnum = scandir(dir.c_str(), &filelist, 0, alphasort);
+    if (fnum < 0)
+        return -1;
+    for(int i = 0; i < fnum; i++) {
+        size_t len = strlen(filelist[i]->d_name);
+        if (len >= 4 && strcmp(filelist[i]->d_name + len - 4, ".jpg") == 0)
+            files.push_back(dir + "/" + filelist[i]->d_name);
+        free(filelist[i]);
+    }
+    free(filelist);
+    return 0;
+}
+
+int FrameHasher::HashDir(const string& dir, vector<uint64_t>& frames, bool progress)
+{
+    vector<string> files;
+    if (ListFrames(dir, files) < 0)
+        return -1;
+    return HashFiles(files, frames, progress);
+}
+
+int FrameHasher::HashFiles(const vector<string>& files, vector<uint64_t>& frames, bool progress)
+{
+    size_t total = files.size();
+    /* by position in 'files', for the order */
+    vector<uint64_t> hashes(total);
+    vector<char> hashed(total, 0);
+    /* positions to decode, all but the cached */
+    vector<size_t> todo;
+    vector<HashCache::Key> keys;
+    if (cache_) {
+        keys.resize(total);
+        for(size_t i = 0; i < total; i++) {
+            if (cache_->Get(files[i], mode_, hashes[i], keys[i]))
+                hashed[i] = 1;
+            else
+                todo.push_back(i);
+        }
+    } else {
+        for(size_t i = 0; i < total; i++)
+            todo.push_back(i);
+    }
+    size_t todo_num = todo.size();
+    atomic<size_t> next(0);
+    size_t done = total - todo_num;
+    bool finished = false;
+    mutex m;
+    condition_variable cv;
+
+    /* keeps the files of frames [next, next + prefetch_) read ahead */
+    thread prefetcher([&]() {
+        size_t fetched = 0;
+        unique_lock<mutex> lock(m);
+        while(!finished && fetched < todo_num) {
+            size_t limit = min(todo_num, next.load() + prefetch_);
+            while(fetched < limit) {
+                lock.unlock();
+                read_ahead(files[todo[fetched++]]);
+                lock.lock();
+            }
+            cv.wait(lock, [&]() { return finished || next.load() + prefetch_ > fetched; });
+        }
+    });
+
+    vector<thread> workers;
+    for(int t = 0; t < threads_; t++) {
+        workers.push_back(thread([&]() {
+            HashContext ctx;
+            size_t k;
+            while((k = next++) < todo_num) {
+                size_t i = todo[k];
+                {
+                    lock_guard<mutex> lock(m);
+                }
+                cv.notify_one();
+
+                uint64_t hresult;
+                if (GetHashCode(ctx, files[i].c_str(), hresult, mode_) < 0) {
+                    fprintf(stderr, "Analyze image %s failed\n", files[i].c_str());
+                } else {
+                    hashes[i] = hresult;
+                    hashed[i] = 1;
+                }
+
+                lock_guard<mutex> lock(m);
+                done++;
+                if (progress)
+                    fprintf(stderr, "\r%d / %d\t\t\t\t\t", (int)done, (int)total);
+            }
+        }));
+    }
+    for(auto& w : workers)
+        w.join();
+    {
+        lock_guard<mutex> lock(m);
+        finished = true;
+    }
+    cv.notify_all();
+    prefetcher.join();
+
+    if (cache_) {
+        for(size_t i : todo)
+            if (hashed[i])
+                cache_->Put(keys[i], hashes[i]);
+        if (cache_->Flush() < 0)
+            fprintf(stderr, "Write hash cache failed\n");
+    }
+
+    frames.clear();
+    frames.reserve(total);
+    for(size_t i = 0; i < total; i++)
+        if (hashed[i])
+            frames.push_back(hashes[i]);
+    return 0;
+}
+
+
+}
+
@@ -0,0 +1,48 @@
+#ifndef _FRAMEHASHER_HPP_
+#define _FRAMEHASHER_HPP_
+#include <ImageProcessor.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace VideoMatch {
+
+class HashCache;
+
+/* Hashes the frames (.jpg files) of a directory on a pool of threads.
+
+   Frames are taken in filename order by the threads, and a prefetch
+   thread asks the kernel to read ahead the files of up to 'prefetch'
+   frames after the last one taken, so decoding does not wait on the disk.
+   Hashes come out in filename order whatever the threads' timing,
+   frames failing to decode are skipped, as before. */
+class FrameHasher
+{
+    int threads_;
+    int prefetch_;
+    HashMode mode_;
+    HashCache *cache_;
+public:
+    /* 0 threads means one per core */
+    FrameHasher(int threads = 0, int prefetch = 0, HashMode mode = HASH_LEGACY);
+
+    int Threads() const { return threads_; }
+    /* frames found in 'cache' are not decoded, those hashed are added to
+       it, nullptr for none, the default */
+    void SetCache(HashCache *cache) { cache_ = cache; }
+
+    /* .jpg files of 'dir' in filename order, return -1 if not readable */
+    static int ListFrames(const std::string& dir, std::vector<std::string>& files);
+
+    /* hash the frames of 'dir' into 'frames',
+       'progress' prints "done / total" on stderr as frames finish */
+    int HashDir(const std::string& dir, std::vector<uint64_t>& frames, bool progress = false);
+    int HashFiles(const std::vector<std::string>& files, std::vector<uint64_t>& frames,
+            bool progress = false);
+};
+
+
+}
+
+#endif
+
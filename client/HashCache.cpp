@@ -0,0 +1,246 @@
+#include <HashCache.hpp>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace VideoMatch {
+
+namespace {
+
+static const char *FILE_SIG = "VideoMatchHashCache";
+
+template<typename T>
+void put(string& buf, T value)
+{
+    buf.append((const char *)&value, sizeof(value));
+}
+
+template<typename T>
+bool get(const char *&p, const char *end, T& value)
+{
+    if (end - p < (long)sizeof(value))
+        return false;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+string header()
+{
+    string buf(FILE_SIG);
+    put<uint32_t>(buf, HASH_VERSION);
+    return buf;
+}
+
+/* flock() of 'path'.lock, not of the cache file itself, which rewrite()
+   replaces: a lock on the old inode would not keep anyone out of the new */
+class FileLock
+{
+    int fd_;
+public:
+    FileLock(const string& path, int op)
+    {
+        fd_ = open((path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ >= 0 && flock(fd_, op) < 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+    ~FileLock()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+    bool Locked() const { return fd_ >= 0; }
+    /* LOCK_SH to LOCK_EX is not atomic, what was read under the shared
+       lock must be read again */
+    bool Exclusive()
+    {
+        return fd_ >= 0 && flock(fd_, LOCK_EX) == 0;
+    }
+};
+
+} //end of namespace
+
+string HashCache::map_key(const string& path, uint8_t mode)
+{
+    string key = path;
+    key.push_back('\0');
+    key.push_back((char)mode);
+    return key;
+}
+
+void HashCache::put_record(string& buf, const string& path, uint8_t mode, const Entry& entry)
+{
+    put<uint32_t>(buf, path.size());
+    buf.append(path);
+    put<uint8_t>(buf, mode);
+    put<int64_t>(buf, entry.size);
+    put<int64_t>(buf, entry.mtime_ns);
+    put<uint64_t>(buf, entry.hash);
+}
+
+int HashCache::Open(const string& path)
+{
+    path_ = path;
+    pending_.clear();
+
+    FileLock lock(path, LOCK_SH);
+    if (!lock.Locked())
+        return -1;
+    int ret = load();
+    if (ret <= 0)
+        return ret;
+    /* checked again under the exclusive lock, another process may have
+       rewritten it or appended since */
+    if (!lock.Exclusive())
+        return -1;
+    ret = load();
+    if (ret == LOAD_OTHER_VERSION)
+        fprintf(stderr, "Hash cache %s is of another hash version, cleared\n", path.c_str());
+    if (ret <= 0)
+        return ret;
+    return rewrite();
+}
+
+/* called with the lock held */
+int HashCache::load()
+{
+    entries_.clear();
+
+    string buf;
+    FILE *fp = fopen(path_.c_str(), "r");
+    if (fp) {
+        char block[65536];
+        size_t n;
+        while((n = fread(block, 1, sizeof(block), fp)) > 0)
+            buf.append(block, n);
+        fclose(fp);
+    }
+    if (buf.empty())
+        return LOAD_REWRITE;
+
+    const string head = header();
+    if (buf.compare(0, strlen(FILE_SIG), FILE_SIG) != 0)
+        return -1;
+    if (buf.compare(0, head.size(), head) != 0)
+        return LOAD_OTHER_VERSION;
+
+    const char *p = buf.data() + head.size(), *end = buf.data() + buf.size();
+    size_t records = 0;
+    while(p < end) {
+        uint32_t len;
+        uint8_t mode;
+        Entry entry;
+        const char *name = nullptr;
+        if (get(p, end, len) && end - p >= (long)len) {
+            name = p;
+            p += len;
+        }
+        if (name == nullptr || !get(p, end, mode) || !get(p, end, entry.size)
+                || !get(p, end, entry.mtime_ns) || !get(p, end, entry.hash))
+            break;
+        entries_[map_key(string(name, len), mode)] = entry;
+        records++;
+    }
+    /* a record cut by a killed writer, or mostly replaced entries */
+    if (p < end || records > 2 * entries_.size() + 1024)
+        return LOAD_REWRITE;
+    return LOAD_OK;
+}
+
+bool HashCache::Get(const string& file, HashMode mode, uint64_t& hash, Key& key)
+{
+    char real[PATH_MAX];
+    struct stat st;
+    key.path.clear();
+    if (realpath(file.c_str(), real) == nullptr || stat(real, &st) < 0) {
+        stat_.misses++;
+        return false;
+    }
+    key.path = real;
+    key.size = st.st_size;
+    key.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    key.mode = mode;
+
+    auto it = entries_.find(map_key(key.path, key.mode));
+    if (it == entries_.end()) {
+        stat_.misses++;
+        return false;
+    }
+    if (it->second.size != key.size || it->second.mtime_ns != key.mtime_ns) {
+        stat_.stale++;
+        return false;
+    }
+    stat_.hits++;
+    hash = it->second.hash;
+    return true;
+}
+
+void HashCache::Put(const Key& key, uint64_t hash)
+{
+    if (key.path.empty())
+        return;
+    Entry entry = {key.size, key.mtime_ns, hash};
+    entries_[map_key(key.path, key.mode)] = entry;
+    put_record(pending_, key.path, key.mode, entry);
+}
+
+int HashCache::Flush()
+{
+    if (pending_.empty())
+        return 0;
+    /* whole records between processes sharing the file, and into the
+       file a rewrite() may just have renamed there */
+    FileLock lock(path_, LOCK_EX);
+    if (!lock.Locked())
+        return -1;
+    FILE *fp = fopen(path_.c_str(), "a");
+    if (fp == nullptr)
+        return -1;
+    size_t n = fwrite(pending_.data(), 1, pending_.size(), fp);
+    if (fclose(fp) != 0 || n != pending_.size())
+        return -1;
+    pending_.clear();
+    return 0;
+}
+
+/* the entries only, into a new file renamed over the old, called with
+   the exclusive lock held */
+int HashCache::rewrite()
+{
+    string buf = header();
+    for(const auto& e : entries_) {
+        size_t sep = e.first.size() - 2;
+        put_record(buf, e.first.substr(0, sep), (uint8_t)e.first[sep + 1], e.second);
+    }
+    string tmp = path_ + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+        return -1;
+    FILE *fp = fdopen(fd, "w");
+    if (fp == nullptr || fchmod(fd, 0644) < 0) {
+        if (fp)
+            fclose(fp);
+        else
+            close(fd);
+        remove(tmp.c_str());
+        return -1;
+    }
+    size_t n = fwrite(buf.data(), 1, buf.size(), fp);
+    if (fclose(fp) != 0 || n != buf.size() || rename(tmp.c_str(), path_.c_str()) < 0) {
+        remove(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+
+}
+
@@ -0,0 +1,87 @@
+#ifndef _HASHCACHE_HPP_
+#define _HASHCACHE_HPP_
+#include <ImageProcessor.hpp>
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+namespace VideoMatch {
+
+/* Hashes of frame files kept on disk between runs, so a rerun over the
+   same directories decodes nothing but what changed.
+
+   A file is known by its real path, size and modification time, a hash
+   is kept per HashMode. The file starts with HASH_VERSION, a cache of
+   another version is cleared on Open(). Entries are appended by Flush(),
+   and Open() rewrites it without the replaced entries once they are most
+   of it. Processes can share the file: all of it is done under flock() of
+   '<path>.lock', shared while loading, exclusive to append or rewrite.
+   Not thread safe. */
+class HashCache
+{
+public:
+    struct Key
+    {
+        std::string path;
+        int64_t size;
+        int64_t mtime_ns;
+        uint8_t mode;
+    };
+
+    struct Stat
+    {
+        long hits;
+        /* not in the cache */
+        long misses;
+        /* in the cache, but the file changed since */
+        long stale;
+    };
+
+    HashCache() : stat_{0, 0, 0} {}
+
+    /* load 'path', created if missing, return -1 if it is not a cache
+       file or can not be written */
+    int Open(const std::string& path);
+
+    /* the hash of 'file' if cached, 'key' is filled for Put() either way,
+       false also if 'file' can not be stat'ed, with key.path empty */
+    bool Get(const std::string& file, HashMode mode, uint64_t& hash, Key& key);
+    void Put(const Key& key, uint64_t hash);
+    /* append what was Put() since the last Flush() */
+    int Flush();
+
+    const Stat& GetStat() const { return stat_; }
+    size_t Count() const { return entries_.size(); }
+
+private:
+    struct Entry
+    {
+        int64_t size;
+        int64_t mtime_ns;
+        uint64_t hash;
+    };
+
+    /* path and mode */
+    static std::string map_key(const std::string& path, uint8_t mode);
+    static void put_record(std::string& buf, const std::string& path, uint8_t mode, const Entry& entry);
+    enum {
+        LOAD_OK,
+        LOAD_REWRITE,
+        LOAD_OTHER_VERSION,
+    };
+    /* into entries_, LOAD_* or -1 if not a cache file */
+    int load();
+    int rewrite();
+
+    std::string path_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::string pending_;
+    Stat stat_;
+};
+
+
+}
+
+#endif
+
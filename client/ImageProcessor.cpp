@@ -1,139 +1,221 @@
 
-#ifdef IMAGETEST 
-#include <stdint.h>
-#else
 #include <ImageProcessor.hpp>
-#endif
 
 
 #define cimg_use_jpeg
 #include <CImg.h>
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <vector>
+#include <jpeglib.h>
 
 using namespace cimg_library;
 
 
 namespace VideoMatch {
 
-static CImg<float>* ph_dct_matrix(const int N) 
+HashContext::HashContext()
 {
-    CImg<float> *ptr_matrix = new CImg<float>(N,N,1,1,1/sqrt((float)N));
+    /* as ph_dct_matrix() of pHash, with the same float and double steps */
+    const int N = SIZE;
     const float c1 = sqrt(2.0/N);
     for (int x=0;x<N;x++){
+        dct_[x] = 1/sqrt((float)N);
+    }
     for (int y=1;y<N;y++){
-        *ptr_matrix->data(x,y) = c1*cos((cimg::PI/2/N)*y*(2*x+1));
+    for (int x=0;x<N;x++){
+        dct_[y*N+x] = c1*cos((cimg::PI/2/N)*y*(2*x+1));
     }
     }
-    return ptr_matrix;
 }
 
-static int crop_border(CImg<float>& img)
+uint64_t HashContext::Hash(const float *img)
 {
-    static const float SD_DIFF_THRESHOLD = 10.0;
-    static const float AVG_DIFF_THRESHOLD = 255.0;
-    int x1, x2, y1, y2;
-    float last_avg = 0;
-
-    x1 = x2 = y1 = y2 = 0;
-    for(int y = 0; y < img.height() / 2; y++) {
-        float sum = 0, avg = 0; 
-        int count = img.width();
-        for(int x = 0; x < img.width(); x++) {
-            sum += *(img.data(x, y));
-        }
-        avg = sum / count;
-        sum = 0;
-        for(int x = 0; x < img.width(); x++) {
-            sum += pow(avg - *(img.data(x, y)), 2);
-        }
-        sum /= count;
-        sum = sqrt(sum);
-        float avg_diff = avg - last_avg;
-        if (avg_diff < 0) avg_diff = -avg_diff;
-        if (y == 0)
-            last_avg = avg;
-        y1 = y;
-        if (sum > SD_DIFF_THRESHOLD || 
-                (y != 0 && avg_diff > AVG_DIFF_THRESHOLD)) {
-            break;
+    /* rows_[r] = row r + 1 of C * img, k in the order of CImg's operator*() */
+    for(int r = 0; r < BLOCK; r++) {
+        const float *c = dct_ + (r + 1) * SIZE;
+        for(int i = 0; i < SIZE; i++)
+            acc_[i] = 0;
+        for(int k = 0; k < SIZE; k++) {
+            const float ck = c[k];
+            const float *row = img + k * SIZE;
+            for(int i = 0; i < SIZE; i++)
+                acc_[i] += ck * row[i];
         }
+        for(int i = 0; i < SIZE; i++)
+            rows_[r * SIZE + i] = acc_[i];
     }
 
-    for(int y = 0; y < img.height() / 2; y++) {
-        float sum = 0, avg = 0; 
-        int count = img.width();
-        for(int x = 0; x < img.width(); x++) {
-            sum += *(img.data(x, img.height() - 1 - y));
-        }
-        avg = sum / count;
-        sum = 0;
-        for(int x = 0; x < img.width(); x++) {
-            sum += pow(avg - *(img.data(x, img.height() - 1 - y)), 2);
-        }
-        sum /= count;
-        sum = sqrt(sum);
-        float avg_diff = avg - last_avg;
-        if (avg_diff < 0) avg_diff = -avg_diff;
-        if (y == 0)
-            last_avg = avg;
-        y2 = img.height() - y;
-        if (sum > SD_DIFF_THRESHOLD || 
-                (y != 0 && avg_diff > AVG_DIFF_THRESHOLD)) {
-            break;
+    /* coefficient (r + 1, j + 1) of (C * img) * C', row after row, as unroll('x') */
+    for(int r = 0; r < BLOCK; r++) {
+        const float *row = rows_ + r * SIZE;
+        for(int j = 0; j < BLOCK; j++) {
+            const float *c = dct_ + (j + 1) * SIZE;
+            double value = 0;
+            for(int k = 0; k < SIZE; k++)
+                value += row[k] * c[k];
+            coeffs_[r * BLOCK + j] = value;
         }
     }
 
-    for(int x = 0; x < img.width() / 2; x++) {
-        float sum = 0, avg = 0; 
-        int count = img.width();
-        for(int y = 0; y < img.height(); y++) {
-            sum += *(img.data(x, y));
+    /* median of an even count, as CImg::median() */
+    const int n = BLOCK * BLOCK;
+    std::copy(coeffs_, coeffs_ + n, sorted_);
+    std::nth_element(sorted_, sorted_ + n / 2, sorted_ + n);
+    float upper = sorted_[n / 2];
+    float lower = *std::max_element(sorted_, sorted_ + n / 2);
+    float median = (upper + lower) / 2;
+
+    uint64_t result = 0;
+    uint64_t one = 0x0000000000000001;
+    for (int i=0;i< n;i++){
+        if (coeffs_[i] > median)
+            result |= one;
+        one = one << 1;
+    }
+    return result;
+}
+
+/* shorter side of the luma the fast path works on */
+static const int FAST_WORK_SIZE = 128;
+
+static const float SD_DIFF_THRESHOLD = 10.0;
+static const float AVG_DIFF_THRESHOLD = 255.0;
+
+/* mean and deviation of a row or column as the former per line loops had
+   them, float in the same order, for the decisions too close to call from
+   the sums. A column is divided by the width, not its height, as it was */
+static void line_stats(CImg<float>& img, bool row, int i, float& avg, float& sd)
+{
+    const int n = row ? img.width() : img.height();
+    const int count = img.width();
+    float sum = 0;
+    for(int k = 0; k < n; k++)
+        sum += row ? *(img.data(k, i)) : *(img.data(i, k));
+    avg = sum / count;
+    sum = 0;
+    for(int k = 0; k < n; k++)
+        sum += pow(avg - (row ? *(img.data(k, i)) : *(img.data(i, k))), 2);
+    sum /= count;
+    sd = sqrt(sum);
+}
+
+/* sums and sums of squares of the lines 'first' .. 'first' + n - 1 (at
+   most LINE_BLOCK), in double. A row is summed in LANES independent sums,
+   columns side by side down the rows, both read along rows and both
+   loops the compiler can vectorize */
+static const int LINE_BLOCK = 8;
+
+static void line_sums(CImg<float>& img, bool row, int first, int n, double *sum, double *sq)
+{
+    static const int LANES = 8;
+    if (row) {
+        for(int j = 0; j < n; j++) {
+            const float *p = img.data(0, first + j);
+            const int w = img.width();
+            double lane_sum[LANES] = {0}, lane_sq[LANES] = {0};
+            int x = 0;
+            for(; x + LANES <= w; x += LANES) {
+                for(int l = 0; l < LANES; l++) {
+                    const double v = p[x + l];
+                    lane_sum[l] += v;
+                    lane_sq[l] += v * v;
+                }
+            }
+            double s = 0, q = 0;
+            for(; x < w; x++) {
+                s += p[x];
+                q += (double)p[x] * p[x];
+            }
+            for(int l = 0; l < LANES; l++) {
+                s += lane_sum[l];
+                q += lane_sq[l];
+            }
+            sum[j] = s;
+            sq[j] = q;
         }
-        avg = sum / count;
-        sum = 0;
+    } else {
+        for(int j = 0; j < n; j++)
+            sum[j] = sq[j] = 0;
         for(int y = 0; y < img.height(); y++) {
-            sum += pow(avg - *(img.data(x, y)), 2);
-        }
-        sum /= count;
-        sum = sqrt(sum);
-        float avg_diff = avg - last_avg;
-        if (avg_diff < 0) avg_diff = -avg_diff;
-        if (x == 0)
-            last_avg = avg;
-        x1 = x;
-        if (sum > SD_DIFF_THRESHOLD || 
-                (x != 0 && avg_diff > AVG_DIFF_THRESHOLD)) {
-            break;
+            const float *p = img.data(first, y);
+            for(int j = 0; j < n; j++) {
+                const double v = p[j];
+                sum[j] += v;
+                sq[j] += v * v;
+            }
         }
     }
+}
 
-    for(int x = 0; x < img.width() / 2; x++) {
-        float sum = 0, avg = 0; 
-        int count = img.width();
-        for(int y = 0; y < img.height(); y++) {
-            sum += *(img.data(img.width() - 1 - x, y));
-        }
-        avg = sum / count;
-        sum = 0;
-        for(int y = 0; y < img.height(); y++) {
-            sum += pow(avg - *(img.data(img.width() - 1 - x, y)), 2);
+/* index from the side of the first of the 'n' rows or columns there that
+   is not border: deviation above SD_DIFF_THRESHOLD, or mean more than
+   AVG_DIFF_THRESHOLD from the first one's, n - 1 if none. 'reverse' scans
+   from the bottom or the right. The sums are taken LINE_BLOCK lines at a
+   time as the scan gets there, the decision is theirs where they are
+   clear of the thresholds, line_stats()'s else */
+static int border_end(CImg<float>& img, bool row, bool reverse, int n)
+{
+    const double MARGIN = 0.01;
+    const double var_threshold = (double)SD_DIFF_THRESHOLD * SD_DIFF_THRESHOLD;
+    const int lines = row ? img.height() : img.width();
+    const int len = row ? img.width() : img.height();
+    const int count = img.width();
+    double sum[LINE_BLOCK], sq[LINE_BLOCK];
+    double first_avg = 0;
+
+    for(int k = 0; k < n; k++) {
+        const int b = k % LINE_BLOCK;
+        if (b == 0) {
+            const int m = std::min(LINE_BLOCK, n - k);
+            line_sums(img, row, reverse ? lines - k - m : k, m, sum, sq);
+            /* lines of the block in scan order */
+            if (reverse) {
+                std::reverse(sum, sum + m);
+                std::reverse(sq, sq + m);
+            }
         }
-        sum /= count;
-        sum = sqrt(sum);
-        float avg_diff = avg - last_avg;
-        if (avg_diff < 0) avg_diff = -avg_diff;
-        if (x == 0)
-            last_avg = avg;
-        x2 = img.width() - x;
-        if (sum > SD_DIFF_THRESHOLD || 
-                (x != 0 && avg_diff > AVG_DIFF_THRESHOLD)) {
-            break;
+        const int i = reverse ? lines - 1 - k : k;
+        const double avg = sum[b] / count;
+        const double var = (sq[b] - 2 * avg * sum[b] + len * avg * avg) / count;
+        if (k == 0)
+            first_avg = avg;
+        const double avg_diff = fabs(avg - first_avg);
+        if (fabs(var - var_threshold) <= var_threshold * MARGIN
+                || avg_diff >= AVG_DIFF_THRESHOLD - 1) {
+            float exact_avg, exact_sd, exact_first, first_sd;
+            line_stats(img, row, i, exact_avg, exact_sd);
+            line_stats(img, row, reverse ? lines - 1 : 0, exact_first, first_sd);
+            float exact_diff = exact_avg - exact_first;
+            if (exact_diff < 0) exact_diff = -exact_diff;
+            if (exact_sd > SD_DIFF_THRESHOLD ||
+                    (k != 0 && exact_diff > AVG_DIFF_THRESHOLD))
+                return k;
+        } else if (var > var_threshold) {
+            return k;
         }
     }
+    return n - 1;
+}
+
+/* 'min_size' is the smallest width or height worth hashing after crop */
+static int crop_border(CImg<float>& img, int min_size = 32)
+{
+    const int w = img.width(), h = img.height();
+    /* nothing left after crop */
+    if (w / 2 == 0 || h / 2 == 0)
+        return -1;
+
+    int y1 = border_end(img, true, false, h / 2);
+    int y2 = h - border_end(img, true, true, h / 2);
+    int x1 = border_end(img, false, false, w / 2);
+    int x2 = w - border_end(img, false, true, w / 2);
 
     int nw = x2 - x1;
     int nh = y2 - y1;
     /* too small after crop, useless */
-    if (nh < 32 || nw < 32)
+    if (nh < min_size || nw < min_size)
         return -1;
     x1 += nw * 0.1;
     x2 -= nw * 0.1;
@@ -170,13 +252,9 @@ static void mirror(CImg<float>& img)
         img.mirror('x');
 }
 
-int GetHashCode(const char *filename, uint64_t& result)
+/* luma as uint8, Y of RGBtoYCbCr() for color images */
+static int load_luma(const char *filename, CImg<uint8_t>& luma)
 {
-    result = 0x0000000000000000;
-    if (!filename) {
-	    return -1;
-    }
-
     CImg<uint8_t> src;
     try {
 	    src.load(filename);
@@ -184,73 +262,261 @@ int GetHashCode(const char *filename, uint64_t& result)
 	    return -1;
     }
 
-    CImg<float> meanfilter(7,7,1,1,1);
-    CImg<float> img;
-    CImg<float> c0;
-
     if (src.spectrum() == 3){
-        c0 = src.RGBtoYCbCr().channel(0);
+        src.RGBtoYCbCr().channel(0);
     } else if (src.spectrum() == 4) {
-	    int width = img.width();
-        int height = img.height();
-        int depth = img.depth();
-	    c0 = src.crop(0,0,0,0,width-1,height-1,depth-1,2)
+	    int width = luma.width();
+        int height = luma.height();
+        int depth = luma.depth();
+	    src.crop(0,0,0,0,width-1,height-1,depth-1,2)
             .RGBtoYCbCr().channel(0);
     } else {
-	    c0 = src.channel(0);
+	    src.channel(0);
+    }
+    luma.swap(src);
+    return 0;
+}
+
+/* libjpeg errors jump back to the decoder instead of exit() */
+struct jpeg_error
+{
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((jpeg_error *)cinfo->err)->jump, 1);
+}
+
+/* luma of a JPEG decoded by libjpeg at 1/2, 1/4 or 1/8 of its size, the
+   smallest keeping 'min_side' pixels on the shorter side. The output is
+   grayscale, so chroma is not decoded, and the IDCT is done on the scaled
+   blocks, nothing of the full size is ever allocated. 'scale' is the
+   denominator taken. JFIF luma is full range, it is mapped to the 16..235
+   of RGBtoYCbCr() as load_luma() has it, for the thresholds of
+   crop_border(). -1 for what is not a JPEG of luma, left to load_luma() */
+static int load_luma_scaled(const char *filename, int min_side, CImg<uint8_t>& luma, int& scale)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == nullptr)
+        return -1;
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    if (cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(fp);
+        return -1;
     }
 
+    const int side = std::min(cinfo.image_width, cinfo.image_height);
+    scale = 1;
+    while(scale < 8 && side / (scale * 2) >= min_side)
+        scale *= 2;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&cinfo);
+
+    luma.assign(cinfo.output_width, cinfo.output_height, 1, 1);
+    while(cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = luma.data(0, cinfo.output_scanline);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    const bool color = cinfo.jpeg_color_space == JCS_YCbCr;
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+
+    if (color) {
+        uint8_t *p = luma.data();
+        for(size_t i = 0, n = (size_t)luma.width() * luma.height(); i < n; i++)
+            p[i] = 16 + (p[i] * 219 + 127) / 255;
+    }
+    return 0;
+}
+
+static int hash_legacy(HashContext& ctx, const CImg<uint8_t>& luma, uint64_t& result)
+{
+    CImg<float> meanfilter(7,7,1,1,1);
+    CImg<float> img;
+    CImg<float> c0(luma);
+
     if (crop_border(c0) < 0) {
         return 0;
     }
     mirror(c0);
     img = c0.get_convolve(meanfilter);
     img.resize(32,32);
-    CImg<float> *C  = ph_dct_matrix(32);
-    CImg<float> Ctransp = C->get_transpose();
-    CImg<float> dctImage = (*C)*img*Ctransp;
-    CImg<float> subsec = dctImage.crop(1,1,8,8).unroll('x');;
-   
-    float median = subsec.median();
-    uint64_t one = 0x0000000000000001;
-    for (int i=0;i< 64;i++){
-	    float current = subsec(i);
-        if (current > median)
-	        result |= one;
-	    one = one << 1;
+    result = ctx.Hash(img.data());
+    return 0;
+}
+
+/* mean of each factor x factor box, the rows of a box are summed into
+   'acc' first, so the inner loops are plain integer adds over a row */
+static void box_downsample(const CImg<uint8_t>& src, int factor, std::vector<uint32_t>& acc,
+        CImg<float>& dst)
+{
+    const int w = src.width() / factor, h = src.height() / factor;
+    const int span = w * factor;
+    const float inv = 1.0f / (factor * factor);
+
+    dst.assign(w, h, 1, 1);
+    acc.resize(span);
+    for(int y = 0; y < h; y++) {
+        std::fill(acc.begin(), acc.end(), 0);
+        for(int dy = 0; dy < factor; dy++) {
+            const uint8_t *row = src.data(0, y * factor + dy);
+            for(int x = 0; x < span; x++)
+                acc[x] += row[x];
+        }
+        float *out = dst.data(0, y);
+        for(int x = 0; x < w; x++) {
+            uint32_t sum = 0;
+            for(int dx = 0; dx < factor; dx++)
+                sum += acc[x * factor + dx];
+            out[x] = sum * inv;
+        }
     }
-  
-    delete C;
+}
 
+/* the legacy steps on the luma box downsampled to about FAST_WORK_SIZE
+   pixels on its shorter side, with the sizes of crop and smoothing scaled,
+   'scale' is how much smaller than the image the luma already is */
+static int hash_fast(HashContext& ctx, const CImg<uint8_t>& luma, int scale, uint64_t& result)
+{
+    const int factor = std::max(1, std::min(luma.width(), luma.height()) / FAST_WORK_SIZE);
+    const int total = scale * factor;
+    CImg<float> c0;
+    CImg<float> img;
+
+    box_downsample(luma, factor, ctx.box_sums, c0);
+    if (crop_border(c0, std::max(32 / total, 1)) < 0) {
+        return 0;
+    }
+    mirror(c0);
+    /* odd, 1 once the box is wider than the legacy filter */
+    const int filter = (7 / total) | 1;
+    if (filter > 1)
+        img = c0.get_convolve(CImg<float>(filter,filter,1,1,1));
+    else
+        img.swap(c0);
+    img.resize(32,32);
+    result = ctx.Hash(img.data());
     return 0;
 }
 
+int GetHashCode(const char *filename, uint64_t& result, HashMode mode)
+{
+    static thread_local HashContext ctx;
+    return GetHashCode(ctx, filename, result, mode);
+}
+
+int GetHashCode(HashContext& ctx, const char *filename, uint64_t& result, HashMode mode)
+{
+    result = 0x0000000000000000;
+    if (!filename) {
+	    return -1;
+    }
+
+    CImg<uint8_t> luma;
+    if (mode == HASH_FAST) {
+        int scale;
+        if (load_luma_scaled(filename, FAST_WORK_SIZE, luma, scale) < 0) {
+            scale = 1;
+            if (load_luma(filename, luma) < 0)
+                return -1;
+        }
+        return hash_fast(ctx, luma, scale, result);
+    }
+    if (load_luma(filename, luma) < 0)
+        return -1;
+    return hash_legacy(ctx, luma, result);
+}
+
 
 }
 
-#ifdef IMAGETEST 
+#ifdef IMAGETEST
 #include <dirent.h>
+#include <time.h>
 
 using namespace VideoMatch;
 
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* image_test <dir> [legacy|fast|verify]
+   prints "<frame> <hash>" of each .jpg of dir, by the legacy or fast path,
+   verify prints "<frame> <legacy> <fast> <distance>" and a summary */
 int main(int argc, char *argv[])
 {
+    const char *mode = argc > 2 ? argv[2] : "legacy";
+    bool verify = strcmp(mode, "verify") == 0;
+    HashContext ctx;
+    /* distances 0, 1, 2, 3-4, 5-8, 9+ */
+    int hist[6] = {0};
+    long frames = 0, total_distance = 0;
+    double legacy_ms = 0, fast_ms = 0;
+
     struct dirent **filelist;
     int fnum = scandir(argv[1], &filelist, 0, alphasort);
     for(int i = 0; i < fnum; i++) {
         char filename[128];
-        uint64_t hresult;
+        uint64_t hresult, fresult;
         int ret;
 
         const char *sfx = filelist[i]->d_name + strlen(filelist[i]->d_name) - 4;
         if (strcmp(sfx, ".jpg"))
             continue;
         snprintf(filename, 128, "%s/%s", argv[1], filelist[i]->d_name);
-        ret = GetHashCode(filename, hresult);
-        printf("%d %llx\n", atoi(filelist[i]->d_name), hresult);
+        if (!verify) {
+            ret = GetHashCode(ctx, filename, hresult,
+                    strcmp(mode, "fast") == 0 ? HASH_FAST : HASH_LEGACY);
+            printf("%d %llx\n", atoi(filelist[i]->d_name), hresult);
+            free(filelist[i]);
+            continue;
+        }
+
+        double t0 = now_ms();
+        ret = GetHashCode(ctx, filename, hresult, HASH_LEGACY);
+        double t1 = now_ms();
+        ret |= GetHashCode(ctx, filename, fresult, HASH_FAST);
+        legacy_ms += t1 - t0;
+        fast_ms += now_ms() - t1;
+        if (ret < 0)
+            continue;
+        int d = __builtin_popcountll(hresult ^ fresult);
+        hist[d <= 2 ? d : d <= 4 ? 3 : d <= 8 ? 4 : 5]++;
+        total_distance += d;
+        frames++;
+        printf("%d %llx %llx %d\n", atoi(filelist[i]->d_name), hresult, fresult, d);
         free(filelist[i]);
     }
     //free(filelist);
+
+    if (verify && frames) {
+        printf("verify frames=%ld mean_distance=%.2f d0=%d d1=%d d2=%d d3_4=%d d5_8=%d d9_=%d "
+                "legacy_ms=%.2f fast_ms=%.2f\n",
+                frames, (double)total_distance / frames, hist[0], hist[1], hist[2], hist[3], hist[4], hist[5],
+                legacy_ms / frames, fast_ms / frames);
+    }
  
     return 0;
 }
@@ -1,10 +1,60 @@
 #ifndef _IMAGEPROCESSOR_HPP_
 #define _IMAGEPROCESSOR_HPP_
 #include <stdint.h>
+#include <vector>
 
 namespace VideoMatch {
 
-int GetHashCode(const char *filename, uint64_t& result);
+/* What hashing one image after another can keep: the DCT basis,
+   computed once, and scratch buffers. Not thread safe, one per thread.
+
+   The pHash is the median test of the 8x8 DCT coefficients at (1,1) of a
+   32x32 image, of the full C * img * C' that was computed by CImg. Only
+   rows 1..8 of C * img are needed for them: 8x32x32 plus 8x8x32
+   multiplies, in fixed size loops instead of 2x32x32x32. The products are
+   float and the sums double in the same order as CImg's, so hashes are
+   identical to those of the matrices. */
+class HashContext
+{
+public:
+    static const int SIZE = 32;
+    static const int BLOCK = 8;
+
+    HashContext();
+    /* pHash of a SIZE x SIZE image, row by row */
+    uint64_t Hash(const float *img);
+
+    /* row sums of the fast path's downsampling */
+    std::vector<uint32_t> box_sums;
+
+private:
+    /* C of ph_dct_matrix(SIZE), row by row */
+    float dct_[SIZE * SIZE];
+    /* rows 1..BLOCK of C * img */
+    float rows_[BLOCK * SIZE];
+    double acc_[SIZE];
+    float coeffs_[BLOCK * BLOCK];
+    float sorted_[BLOCK * BLOCK];
+};
+
+/* HASH_LEGACY hashes the full resolution luma, as the db was built with,
+   HASH_FAST box downsamples it first to about 128 pixels on the shorter
+   side, then crops, smooths and resizes there. Its hashes are a few bits
+   from the legacy ones (see 'image_test <dir> verify'), do not mix both
+   in one db */
+enum HashMode {
+    HASH_LEGACY,
+    HASH_FAST,
+};
+
+/* of the hashes GetHashCode() computes, bump it with any change of their
+   bits in either mode, hashes kept of other versions are not used */
+static const uint32_t HASH_VERSION = 1;
+
+int GetHashCode(HashContext& ctx, const char *filename, uint64_t& result,
+        HashMode mode = HASH_LEGACY);
+/* by a context of the calling thread */
+int GetHashCode(const char *filename, uint64_t& result, HashMode mode = HASH_LEGACY);
 
 
 }
@@ -1,5 +1,7 @@
 #include <Requester.hpp>
 #include <json/json.h>
+#include <cstdio>
+#include <mutex>
 
 using namespace std;
 
@@ -10,6 +12,8 @@ Request:
     type: string "[add | query_duplicate | query_video | remove]"
     name: string  (when add | query_video | remove)
     frames: array of UInt64 (when add | query_duplicate)
+    positions: array of UInt, index of each frame in the video, when
+               runs of near identical frames were collapsed (optional)
     
 Replay:
     
@@ -27,11 +31,18 @@ static size_t write_data(void *ptr, size_t size, size_t nmemb, void *stream)
     return size * nmemb;
 }
 
-Requester::Requester()
+Requester::Requester(bool verbose)
+    : verbose_(verbose)
 {
-    curl_global_init(CURL_GLOBAL_ALL);
+    /* not thread safe, once per process */
+    static once_flag global_init;
+    call_once(global_init, []() { curl_global_init(CURL_GLOBAL_ALL); });
     curl_handle = curl_easy_init();
     curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_data);
+    /* let server gzip big replies, curl decodes them */
+    curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
+    /* no signals for timeouts, requesters run on several threads */
+    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
 }
 
 Requester::~Requester()
@@ -45,7 +56,25 @@ int Requester::InitUrl(const string& url)
     return 0;
 }
 
-int Requester::Add(const string& name, const vector<uint64_t>& frames, string &reply) 
+int Requester::perform(const string& req_str, string& reply)
+{
+    if (verbose_)
+        printf("Req:\n%s\n", req_str.c_str());
+    reply = "";
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, req_str.c_str());
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &reply);
+    CURLcode ret = curl_easy_perform(curl_handle);
+    if (ret != CURLE_OK) {
+        reply = curl_easy_strerror(ret);
+        return -1;
+    }
+    long status = 0;
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &status);
+    return status / 100 == 2 ? 0 : -1;
+}
+
+int Requester::Add(const string& name, const vector<uint64_t>& frames, string &reply,
+        const vector<uint32_t> *positions)
 {
     Json::StyledWriter writer;
     Json::Value v;
@@ -55,18 +84,16 @@ int Requester::Add(const string& name, const vector<uint64_t>& frames, string &r
     for(size_t i = 0; i < frames.size(); i++) {
         v["frames"][(int)i] = (Json::Value::UInt64)(frames[i]);
     }
+    if (positions) {
+        for(size_t i = 0; i < positions->size(); i++)
+            v["positions"][(int)i] = (Json::Value::UInt)((*positions)[i]);
+    }
     string req_str = writer.write(v);
-    
-    printf("Req:\n%s\n", req_str.c_str());
-    reply = "";
-    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, req_str.c_str());
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &reply);
-    curl_easy_perform(curl_handle);
-
-    return 0;
+    return perform(req_str, reply);
 }
 
-int Requester::Query(const vector<uint64_t>& frames, string& reply)
+int Requester::Query(const vector<uint64_t>& frames, string& reply,
+        const vector<uint32_t> *positions)
 {
     Json::StyledWriter writer;
     Json::Value v;
@@ -75,14 +102,12 @@ int Requester::Query(const vector<uint64_t>& frames, string& reply)
     for(size_t i = 0; i < frames.size(); i++) {
         v["frames"][(int)i] = (Json::Value::UInt64)(frames[i]);
     }
+    if (positions) {
+        for(size_t i = 0; i < positions->size(); i++)
+            v["positions"][(int)i] = (Json::Value::UInt)((*positions)[i]);
+    }
     string req_str = writer.write(v);
- 
-    printf("Req:\n%s\n", req_str.c_str());
-    reply = "";
-    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, req_str.c_str());
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &reply);
-    curl_easy_perform(curl_handle);
-    return 0;
+    return perform(req_str, reply);
 }
 
 }
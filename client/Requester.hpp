@@ -10,12 +10,20 @@ namespace VideoMatch {
 class Requester
 {
     CURL *curl_handle;
+    bool verbose_;
+    int perform(const std::string& req_str, std::string& reply);
 public:
-    Requester();
+    /* 'verbose' prints each request on stdout. A Requester is used by one
+       thread at a time, it keeps its connection alive between requests */
+    Requester(bool verbose = true);
     ~Requester();
     int InitUrl(const std::string& url);
-    int Add(const std::string& name, const std::vector<uint64_t>& frames, std::string &reply);
-    int Query(const std::vector<uint64_t>& frames, std::string& reply);
+    /* -1 if the server was not reached or did not reply 2xx,
+       'positions' of the frames in the video if not all are sent */
+    int Add(const std::string& name, const std::vector<uint64_t>& frames, std::string &reply,
+            const std::vector<uint32_t> *positions = nullptr);
+    int Query(const std::vector<uint64_t>& frames, std::string& reply,
+            const std::vector<uint32_t> *positions = nullptr);
 };
     
 
@@ -1,10 +1,13 @@
-#include <ImageProcessor.hpp>
+#include <BatchUploader.hpp>
+#include <FrameDedup.hpp>
+#include <FrameHasher.hpp>
+#include <HashCache.hpp>
 #include <Requester.hpp>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <dirent.h>
 #include <getopt.h>
+#include <sys/stat.h>
 #include <vector>
 
 using namespace std;
@@ -16,9 +19,51 @@ static void print_usage(const char *sexec)
            "\t-a --addr <url> [required]                      the server address\n"
            "\t-n --name <string> [required when add]          name(key) of the video to add\n"
            "\t-d --dir <path> [required]                      directory that frames stored\n"
+           "\t-b --batch <path> [instead of -n and -d]         add every video of a directory of frame\n"
+           "\t                                                directories, or of a manifest file\n"
+           "\t                                                of \"<name> <dir>\" lines\n"
+           "\t-i --inflight <num> [default 4]                  batch uploads at the same time\n"
+           "\t-C --cache <file>                               keep hashes of frames in the file, and\n"
+           "\t                                                do not decode frames found there\n"
+           "\t-j --jobs <num> [default cores]                 frames hashed at the same time\n"
+           "\t-D --dedup <bits>                               send one frame of each run of frames within\n"
+           "\t                                                that many bits, with the frames' positions\n"
+           "\t-F --fast                                       downscale first, not for dbs of legacy hashes\n"
           , sexec);
 }
 
+/* 'path' a directory of videos, or a manifest */
+static int batch_add(const char *url, const char *path, VideoMatch::FrameHasher& hasher, int inflight,
+        int dedup_bits)
+{
+    using VideoMatch::BatchUploader;
+    vector<BatchUploader::Video> videos;
+    struct stat st;
+    int ret = stat(path, &st) == 0 && S_ISDIR(st.st_mode) ?
+        BatchUploader::ListVideos(path, videos) : BatchUploader::ReadManifest(path, videos);
+    if (ret < 0) {
+        fprintf(stderr, "Can not read %s\n", path);
+        return 1;
+    }
+
+    BatchUploader uploader(url, hasher, inflight, dedup_bits);
+    BatchUploader::Stat stat;
+    ret = uploader.Run(videos, stat);
+    fprintf(stderr, "batch videos=%d failed=%d frames=%ld sent_frames=%ld seconds=%.1f "
+            "videos_per_s=%.2f frames_per_s=%.1f\n",
+            stat.videos, stat.failed, stat.frames, stat.sent_frames, stat.seconds,
+            stat.seconds > 0 ? stat.videos / stat.seconds : 0.0,
+            stat.seconds > 0 ? stat.frames / stat.seconds : 0.0);
+    return ret < 0 ? 1 : 0;
+}
+
+static void print_cache_stat(const VideoMatch::HashCache& cache)
+{
+    const VideoMatch::HashCache::Stat& stat = cache.GetStat();
+    fprintf(stderr, "cache hits=%ld misses=%ld stale=%ld entries=%d\n",
+            stat.hits, stat.misses, stat.stale, (int)cache.Count());
+}
+
 int main(int argc, char *argv[])
 {
 
@@ -26,18 +71,30 @@ int main(int argc, char *argv[])
     const char *name = nullptr;
     const char *url = nullptr;
     const char *req = nullptr;
+    const char *batch = nullptr;
+    const char *cache_file = nullptr;
+    int jobs = 0;
+    int inflight = 4;
+    int dedup_bits = -1;
+    VideoMatch::HashMode mode = VideoMatch::HASH_LEGACY;
 
     static struct option long_options[] = {
         {"req",     required_argument, 0,  'r' },
         {"addr",     required_argument, 0,  'a' },
         {"name",     required_argument, 0,  'n' },
         {"dir",     required_argument, 0,  'd' },
+        {"batch",     required_argument, 0,  'b' },
+        {"inflight",     required_argument, 0,  'i' },
+        {"cache",     required_argument, 0,  'C' },
+        {"jobs",     required_argument, 0,  'j' },
+        {"dedup",     required_argument, 0,  'D' },
+        {"fast",     no_argument,       0,  'F' },
         { 0, 0, 0, 0}
     };
 
     int long_index = 0;
     int opt;
-    while((opt = getopt_long(argc, argv, "r:a:n:d:", long_options, &long_index)) != -1) {
+    while((opt = getopt_long(argc, argv, "r:a:n:d:b:i:C:j:D:F", long_options, &long_index)) != -1) {
         switch(opt) {
             case 'd':
                 dir = optarg;
@@ -51,6 +108,24 @@ int main(int argc, char *argv[])
             case 'n':
                 name = optarg;
                 break;
+            case 'b':
+                batch = optarg;
+                break;
+            case 'i':
+                inflight = atoi(optarg);
+                break;
+            case 'C':
+                cache_file = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'D':
+                dedup_bits = atoi(optarg);
+                break;
+            case 'F':
+                mode = VideoMatch::HASH_FAST;
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
@@ -63,6 +138,27 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    VideoMatch::FrameHasher hasher(jobs, 0, mode);
+    VideoMatch::HashCache cache;
+    if (cache_file) {
+        if (cache.Open(cache_file) < 0) {
+            fprintf(stderr, "Can not use %s as hash cache\n", cache_file);
+            return 1;
+        }
+        hasher.SetCache(&cache);
+    }
+
+    if (batch) {
+        if (url == nullptr || strcasecmp(req, "add") != 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        int ret = batch_add(url, batch, hasher, inflight, dedup_bits);
+        if (cache_file)
+            print_cache_stat(cache);
+        return ret;
+    }
+
     if (url == nullptr || dir == nullptr) {
         print_usage(argv[0]);
         return 1;
@@ -77,37 +173,29 @@ int main(int argc, char *argv[])
     requester.InitUrl(url);
 
     vector<uint64_t> frames;
-    struct dirent **filelist;
-    int fnum = scandir(dir, &filelist, 0, alphasort);
-    for(int i = 0; i < fnum; i++) {
-        char filename[128];
-        uint64_t hresult;
-        int ret;
-
-        const char *sfx = filelist[i]->d_name + strlen(filelist[i]->d_name) - 4;
-        if (strcmp(sfx, ".jpg"))
-            continue;
-        snprintf(filename, 128, "%s/%s", dir, filelist[i]->d_name);
-
-        ret = VideoMatch::GetHashCode(filename, hresult);
-        if (ret < 0) 
-            fprintf(stderr, "Analyze image %s failed\n", filename);
-        else
-            frames.push_back(hresult);
-
-        fprintf(stderr, "\r%d / %d\t\t\t\t\t", i, fnum);
-        free(filelist[i]);
+    if (hasher.HashDir(dir, frames, true) < 0) {
+        fprintf(stderr, "Can not read %s\n", dir);
+        return 1;
     }
     printf("\n");
-    free(filelist);
-
+    if (cache_file)
+        print_cache_stat(cache);
+
+    vector<uint32_t> positions;
+    if (dedup_bits >= 0) {
+        vector<uint64_t> kept;
+        VideoMatch::FrameDedup::Collapse(frames, dedup_bits, kept, positions);
+        fprintf(stderr, "dedup %d of %d frames sent\n", (int)kept.size(), (int)frames.size());
+        frames.swap(kept);
+    }
 
     printf("Requesting...");
     string reply;
+    const vector<uint32_t> *sent_positions = dedup_bits >= 0 ? &positions : nullptr;
     if (strcasecmp(req, "add") == 0)
-        requester.Add(name, frames, reply);
+        requester.Add(name, frames, reply, sent_positions);
     if (strcasecmp(req, "query") == 0)
-        requester.Query(frames, reply);
+        requester.Query(frames, reply, sent_positions);
     printf("done\n");
 
     printf("%s\n", reply.c_str());
@@ -4,7 +4,7 @@ rm -rf *._ret
 
 for v in `awk '{print $1}' duplicate.sorted | uniq`
 do
-    ./client -r query -a "http://localhost:8964/" -n "$i" -d "$1/$v" | grep name | sed -e "s/[\"|\,]//g" | awk -v n=$v '{if(n != $3) print n,$3;}'  | sort > $v._ret &
+    ./client -r query -a "http://localhost:8964/" -n "$i" -d "$1/$v" | grep -o '"name":"[^"]*"' | sed -e 's/^"name":"//' -e 's/"$//' | awk -v n=$v '{if(n != $1) print n,$1;}'  | sort > $v._ret &
 
     p=`ps aux|grep client|wc -l`
 
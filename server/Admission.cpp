@@ -0,0 +1,335 @@
+#include <Admission.hpp>
+#include <JsonWriter.hpp>
+#include <Metrics.hpp>
+#include <TimeCounter.hpp>
+#include <Log.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+
+namespace {
+
+using VideoMatch::Admission;
+
+struct LaneState
+{
+    /* limits, workers 0 means default by SetWorkers() */
+    int max_queued;
+    long max_queued_ms;
+    int workers;
+    int weight;
+
+    /* admitted, not running yet */
+    int queued;
+    long queued_units;
+    /* waiting in Ticket for being scheduled, part of queued */
+    int waiting;
+    int running;
+    /* learnt from finished requests, 0 if not known yet */
+    double us_per_unit;
+
+    /* scheduling: waiters are granted in order of arrival,
+       and lane of least 'pass' goes first, see dispatch() */
+    uint64_t next_seq;
+    uint64_t granted;
+    double pass;
+    condition_variable cv;
+
+    /* counters */
+    uint64_t admitted;
+    uint64_t rejected;
+    uint64_t finished;
+    int64_t queue_wait_us;
+};
+
+/* admitted request not picked by a worker yet */
+struct Pending
+{
+    int lane;
+    long units;
+    int64_t enter_us;
+};
+
+/* weight of the last finished request in us_per_unit */
+static const double EWMA_ALPHA = 0.2;
+static const int MAX_RETRY_AFTER = 60;
+
+static mutex g_mutex;
+static int g_workers = 1;
+static int g_running = 0;
+static LaneState g_lanes[Admission::LANE_NUM];
+static unordered_map<const void *, Pending> g_pending;
+
+static void init_lane(Admission::Lane lane, int max_queued, long max_queued_ms, int weight)
+{
+    LaneState& st = g_lanes[lane];
+    st.max_queued = max_queued;
+    st.max_queued_ms = max_queued_ms;
+    st.workers = 0;
+    st.weight = weight;
+    st.queued = st.waiting = st.running = 0;
+    st.queued_units = 0;
+    st.us_per_unit = 0;
+    st.next_seq = st.granted = 0;
+    st.pass = 0;
+    st.admitted = st.rejected = st.finished = 0;
+    st.queue_wait_us = 0;
+}
+
+static struct LanesInit
+{
+    LanesInit()
+    {
+        init_lane(Admission::INTERACTIVE, 32, 5000, 8);
+        init_lane(Admission::BULK, 16, 60000, 2);
+        init_lane(Admission::INGEST, 32, 0, 2);
+        init_lane(Admission::ADMIN, 2, 0, 1);
+    }
+} g_lanes_init;
+
+/* by default, interactive queries may use every worker,
+   other lanes together leave at least one worker to them, see
+   default_lanes_full() */
+static int lane_workers(int lane)
+{
+    const LaneState& st = g_lanes[lane];
+    if (st.workers > 0)
+        return min(st.workers, g_workers);
+    switch(lane) {
+        case Admission::INTERACTIVE:
+            return g_workers;
+        case Admission::BULK:
+        case Admission::INGEST:
+            return max(1, g_workers / 4);
+        default:
+            return 1;
+    }
+}
+
+/* non-interactive lanes of default workers, bulk:W/4 ingest:W/4 admin:1,
+   would take all W workers for W <= 3. Together they get at most W - 1,
+   so one worker is always left to interactive queries, unless W is 1.
+   called with g_mutex held */
+static bool default_lanes_full()
+{
+    if (g_workers <= 1)
+        return false;
+    int running = 0;
+    for(int i = 0; i < Admission::LANE_NUM; i++)
+        if (i != Admission::INTERACTIVE)
+            running += g_lanes[i].running;
+    return running >= g_workers - 1;
+}
+
+/* stride scheduling: hand free workers to waiting lanes,
+   each grant advances the lane's pass by 1/weight, least pass goes first.
+   called with g_mutex held */
+static void dispatch()
+{
+    while(g_running < g_workers) {
+        int best = -1;
+        for(int i = 0; i < Admission::LANE_NUM; i++) {
+            const LaneState& st = g_lanes[i];
+            if (st.waiting == 0 || st.running >= lane_workers(i)
+                    || (i != Admission::INTERACTIVE && st.workers == 0 && default_lanes_full()))
+                continue;
+            if (best < 0 || st.pass < g_lanes[best].pass)
+                best = i;
+        }
+        if (best < 0)
+            break;
+
+        LaneState& st = g_lanes[best];
+        st.granted++;
+        st.waiting--;
+        st.running++;
+        g_running++;
+        st.pass += 1.0 / max(st.weight, 1);
+        st.cv.notify_all();
+    }
+}
+
+} //end of namespace
+
+
+namespace VideoMatch
+{
+
+Admission::Ticket::Ticket(const void *req)
+    : req_(req), lane_(-1), units_(0), start_us_(TimeCounter::NowMicroS()),
+    enter_us_(start_us_)
+{
+    unique_lock<mutex> lock(g_mutex);
+    auto it = g_pending.find(req);
+    /* not admitted by Enter(), nothing to account */
+    if (it == g_pending.end())
+        return;
+
+    lane_ = it->second.lane;
+    units_ = it->second.units;
+    enter_us_ = it->second.enter_us;
+    g_pending.erase(it);
+
+    LaneState& st = g_lanes[lane_];
+    if (st.waiting == 0) {
+        /* lane was idle, it can not take the share it did not use */
+        for(int i = 0; i < LANE_NUM; i++) {
+            if (g_lanes[i].waiting > 0)
+                st.pass = max(st.pass, g_lanes[i].pass);
+        }
+    }
+    uint64_t seq = st.next_seq++;
+    st.waiting++;
+    dispatch();
+    st.cv.wait(lock, [&st, seq]() { return seq < st.granted; });
+
+    start_us_ = TimeCounter::NowMicroS();
+    st.queued--;
+    st.queued_units -= units_;
+    st.queue_wait_us += start_us_ - enter_us_;
+}
+
+Admission::Ticket::~Ticket()
+{
+    if (lane_ < 0)
+        return;
+
+    int64_t elapsed = TimeCounter::NowMicroS() - start_us_;
+    lock_guard<mutex> lock(g_mutex);
+    LaneState& st = g_lanes[lane_];
+    st.running--;
+    g_running--;
+    st.finished++;
+    double upu = (double)elapsed / max(units_, 1L);
+    if (st.us_per_unit == 0)
+        st.us_per_unit = upu;
+    else
+        st.us_per_unit = st.us_per_unit * (1 - EWMA_ALPHA) + upu * EWMA_ALPHA;
+    dispatch();
+}
+
+void Admission::SetQueueLimit(Lane lane, int max_queued, long max_queued_ms)
+{
+    lock_guard<mutex> lock(g_mutex);
+    g_lanes[lane].max_queued = max_queued;
+    g_lanes[lane].max_queued_ms = max_queued_ms;
+}
+
+void Admission::SetLaneWorkers(Lane lane, int workers, int weight)
+{
+    lock_guard<mutex> lock(g_mutex);
+    g_lanes[lane].workers = workers;
+    if (weight > 0)
+        g_lanes[lane].weight = weight;
+    dispatch();
+}
+
+void Admission::SetWorkers(int workers)
+{
+    lock_guard<mutex> lock(g_mutex);
+    g_workers = max(workers, 1);
+    dispatch();
+}
+
+int Admission::PoolThreads()
+{
+    lock_guard<mutex> lock(g_mutex);
+    int threads = 0;
+    for(int i = 0; i < LANE_NUM; i++)
+        threads += lane_workers(i) + g_lanes[i].max_queued;
+    return max(threads, g_workers);
+}
+
+bool Admission::Enter(const void *req, Lane lane, long units, int& retry_after)
+{
+    lock_guard<mutex> lock(g_mutex);
+    LaneState& st = g_lanes[lane];
+
+    double queued_ms = (st.queued_units + units) * st.us_per_unit / 1000;
+    /* a single request is always accepted by an empty queue, whatever its cost */
+    if (st.queued >= st.max_queued
+            || (st.max_queued_ms && st.queued > 0 && queued_ms > st.max_queued_ms)) {
+        st.rejected++;
+        /* time for the lane's workers to drain what is queued now */
+        retry_after = (int)(st.queued_units * st.us_per_unit / lane_workers(lane) / 1000000) + 1;
+        retry_after = min(retry_after, MAX_RETRY_AFTER);
+        LOG_DEBUG("Reject %s request, %d queued, %.0f ms queued work",
+                LaneName(lane), st.queued, queued_ms);
+        return false;
+    }
+
+    st.queued++;
+    st.queued_units += units;
+    st.admitted++;
+    g_pending[req] = Pending{(int)lane, units, TimeCounter::NowMicroS()};
+    return true;
+}
+
+const char *Admission::LaneName(Lane lane)
+{
+    static const char *names[LANE_NUM] = {"interactive", "bulk", "ingest", "admin"};
+    return names[lane];
+}
+
+void Admission::Stat(JsonWriter& writer)
+{
+    lock_guard<mutex> lock(g_mutex);
+    writer.BeginObject();
+    writer.Key("workers").Int(g_workers);
+    writer.Key("running").Int(g_running);
+    for(int i = 0; i < LANE_NUM; i++) {
+        const LaneState& st = g_lanes[i];
+        uint64_t started = st.finished + st.running;
+        writer.Key(LaneName((Lane)i)).BeginObject()
+            .Key("queued").Int(st.queued)
+            .Key("running").Int(st.running)
+            .Key("queued_ms").Double(st.queued_units * st.us_per_unit / 1000)
+            .Key("workers").Int(lane_workers(i))
+            .Key("weight").Int(st.weight)
+            .Key("max_queued").Int(st.max_queued)
+            .Key("max_queued_ms").Int(st.max_queued_ms)
+            .Key("admitted").UInt(st.admitted)
+            .Key("rejected").UInt(st.rejected)
+            .Key("finished").UInt(st.finished)
+            .Key("avg_queue_wait_ms").Double(started ? st.queue_wait_us / 1000.0 / started : 0)
+            .EndObject();
+    }
+    writer.EndObject();
+}
+
+
+void Admission::Scrape(std::string& out)
+{
+    char labels[LANE_NUM][32];
+    lock_guard<mutex> lock(g_mutex);
+    for(int i = 0; i < LANE_NUM; i++)
+        snprintf(labels[i], sizeof(labels[i]), "lane=\"%s\"", LaneName((Lane)i));
+
+    Metrics::WriteHeader(out, "videomatch_lane_queued", "gauge", "Admitted requests waiting for a worker");
+    for(int i = 0; i < LANE_NUM; i++)
+        Metrics::WriteValue(out, "videomatch_lane_queued", labels[i], g_lanes[i].queued);
+    Metrics::WriteHeader(out, "videomatch_lane_running", "gauge", "Requests being processed");
+    for(int i = 0; i < LANE_NUM; i++)
+        Metrics::WriteValue(out, "videomatch_lane_running", labels[i], g_lanes[i].running);
+    Metrics::WriteHeader(out, "videomatch_lane_queued_seconds", "gauge", "Estimated work waiting for a worker");
+    for(int i = 0; i < LANE_NUM; i++)
+        Metrics::WriteValue(out, "videomatch_lane_queued_seconds", labels[i],
+                g_lanes[i].queued_units * g_lanes[i].us_per_unit / 1e6);
+    Metrics::WriteHeader(out, "videomatch_lane_admitted_total", "counter", "Requests admitted");
+    for(int i = 0; i < LANE_NUM; i++)
+        Metrics::WriteValue(out, "videomatch_lane_admitted_total", labels[i], g_lanes[i].admitted);
+    Metrics::WriteHeader(out, "videomatch_lane_rejected_total", "counter", "Requests rejected with 503");
+    for(int i = 0; i < LANE_NUM; i++)
+        Metrics::WriteValue(out, "videomatch_lane_rejected_total", labels[i], g_lanes[i].rejected);
+    Metrics::WriteHeader(out, "videomatch_lane_queue_wait_seconds_total", "counter", "Time waited for a worker");
+    for(int i = 0; i < LANE_NUM; i++)
+        Metrics::WriteValue(out, "videomatch_lane_queue_wait_seconds_total", labels[i],
+                g_lanes[i].queue_wait_us / 1e6);
+}
+
+}
@@ -0,0 +1,83 @@
+#ifndef _ADMISSION_HPP_
+#define _ADMISSION_HPP_
+#include <stdint.h>
+#include <string>
+
+namespace VideoMatch
+{
+
+
+class JsonWriter;
+
+/* Admission control and scheduling of the requests switched into the thread pool.
+
+   Requests are classified into lanes. The network thread calls Enter() with
+   the estimated cost of a request, it fails fast (reply 503) when the queue
+   of the lane is full, otherwise the request is queued into the thread pool.
+   The worker then holds a Ticket while processing it, getting the Ticket
+   waits until the lane is scheduled:
+     - at most SetWorkers() requests run at the same time, over all lanes
+     - at most 'workers' requests of a lane run at the same time
+     - when lanes compete for a free worker, each lane gets its share
+       in proportion to its 'weight'
+   The thread pool has enough threads for every admitted request (PoolThreads()),
+   so waiting happens here and not in the FIFO of the thread pool.
+
+   Cost is in abstract units (e.g. frames), the time per unit is learnt from
+   finished requests, so queued work can be bounded in milliseconds. */
+class Admission
+{
+public:
+    enum Lane {
+        INTERACTIVE,
+        BULK,
+        INGEST,
+        ADMIN,
+        LANE_NUM,
+    };
+
+    /* held by the worker while processing an admitted request */
+    class Ticket
+    {
+        const void *req_;
+        int lane_;
+        long units_;
+        int64_t start_us_;
+        int64_t enter_us_;
+    public:
+        /* blocks until the request's lane is scheduled */
+        Ticket(const void *req);
+        ~Ticket();
+
+        /* when the request was admitted, by TimeCounter::NowMicroS() */
+        int64_t EnterMicroS() const { return enter_us_; }
+    };
+
+    /* max_queued: requests waiting for a worker,
+       max_queued_ms: estimated work waiting for workers, 0 means no bound */
+    static void SetQueueLimit(Lane lane, int max_queued, long max_queued_ms);
+    /* workers: max requests of the lane running at the same time,
+       weight: share of the lane when competing for workers */
+    static void SetLaneWorkers(Lane lane, int workers, int weight);
+    /* max requests running at the same time, lanes workers are capped by it */
+    static void SetWorkers(int workers);
+    /* threads needed by the thread pool */
+    static int PoolThreads();
+
+    /* 'req' identifies the request until its Ticket is released,
+       return false if the request should be rejected,
+       with 'retry_after' seconds to suggest to the client */
+    static bool Enter(const void *req, Lane lane, long units, int& retry_after);
+
+    static const char *LaneName(Lane lane);
+    static void Stat(JsonWriter& writer);
+    /* append metrics in Prometheus text format */
+    static void Scrape(std::string& out);
+};
+
+
+}
+
+
+#endif
+
@@ -0,0 +1,325 @@
+#include <Capture.hpp>
+#include <TimeCounter.hpp>
+#include <Log.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+namespace {
+
+static const char *FILE_SIG = "VideoMatchCaptureV1";
+
+static atomic<bool> g_enabled(false);
+static atomic<unsigned long> g_seen(0);
+static int g_sample = 1;
+
+/* records wait here for the writer thread, as log messages do in their
+   rings, a request never waits for the disk: past MAX_QUEUED_BYTES the
+   record is dropped and counted */
+static const size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+static const int FLUSH_INTERVAL_MS = 100;
+static mutex g_queue_mutex;
+static condition_variable g_queue_cv;
+static deque<string> g_queue;
+static size_t g_queued_bytes = 0;
+static atomic<unsigned long> g_dropped(0);
+static thread g_writer;
+static bool g_stop = false;
+
+/* the file, rotation as the log's */
+static mutex g_mutex;
+static FILE *g_fp = nullptr;
+static string g_path;
+static long g_file_size = 0;
+static long g_max_bytes = 0;
+static int g_max_files = 5;
+
+template<typename T>
+void put(string& buf, T value)
+{
+    buf.append((const char *)&value, sizeof(value));
+}
+
+template<typename T>
+bool get(const char *&p, const char *end, T& value)
+{
+    if (end - p < (long)sizeof(value))
+        return false;
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+/* capture -> capture.1 -> capture.2 ... the oldest is removed */
+void shift_files()
+{
+    char from[600], to[600];
+    if (g_max_files > 0) {
+        for(int i = g_max_files - 1; i >= 1; i--) {
+            snprintf(from, sizeof(from), "%s.%d", g_path.c_str(), i);
+            snprintf(to, sizeof(to), "%s.%d", g_path.c_str(), i + 1);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", g_path.c_str());
+        rename(g_path.c_str(), to);
+    } else {
+        remove(g_path.c_str());
+    }
+}
+
+/* called with g_mutex held */
+int open_file()
+{
+    g_fp = fopen(g_path.c_str(), "w");
+    if (g_fp == nullptr) {
+        LOG_ERROR("Capture file %s open failed, [%s]", g_path.c_str(), strerror(errno));
+        return -1;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    string header(FILE_SIG);
+    put<int64_t>(header, (int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+    put<int64_t>(header, TimeCounter::NowMicroS());
+    fwrite(header.data(), 1, header.size(), g_fp);
+    g_file_size = header.size();
+    return 0;
+}
+
+/* called with g_mutex held */
+void write_record(const string& record)
+{
+    if (g_max_bytes > 0 && g_file_size + (long)record.size() > g_max_bytes) {
+        if (g_fp)
+            fclose(g_fp);
+        g_fp = nullptr;
+        shift_files();
+        open_file();
+    }
+    if (g_fp == nullptr)
+        return;
+    fwrite(record.data(), 1, record.size(), g_fp);
+    g_file_size += record.size();
+}
+
+/* drains the queue into the file, flushed once per batch so the file holds
+   whole records soon after they are captured */
+void writer_loop()
+{
+    unsigned long reported = 0;
+    deque<string> batch;
+    bool stop = false;
+    while(!stop) {
+        {
+            unique_lock<mutex> lock(g_queue_mutex);
+            g_queue_cv.wait_for(lock, chrono::milliseconds(FLUSH_INTERVAL_MS),
+                    []() { return !g_queue.empty() || g_stop; });
+            /* what is queued at the stop is written still */
+            stop = g_stop;
+            batch.swap(g_queue);
+            g_queued_bytes = 0;
+        }
+        unsigned long dropped = g_dropped.load(memory_order_relaxed);
+        if (dropped != reported) {
+            LOG_WARN("%lu capture records dropped, writer behind", dropped - reported);
+            reported = dropped;
+        }
+        if (batch.empty())
+            continue;
+
+        lock_guard<mutex> lock(g_mutex);
+        for(const auto& record : batch)
+            write_record(record);
+        if (g_fp)
+            fflush(g_fp);
+        batch.clear();
+    }
+}
+
+void capture_at_exit()
+{
+    VideoMatch::Capture::Close();
+}
+
+} //end of namespace
+
+
+namespace VideoMatch
+{
+
+const char *Capture::TypeName(Type type)
+{
+    static const char *names[TYPE_NUM] = {"add", "query_duplicate", "querykey"};
+    return names[type];
+}
+
+int Capture::Open(const char *path, int sample, long max_bytes, int max_files)
+{
+    static bool at_exit = false;
+    lock_guard<mutex> lock(g_mutex);
+    if (g_fp)
+        fclose(g_fp);
+    g_path = path;
+    g_sample = sample > 0 ? sample : 1;
+    g_max_bytes = max_bytes;
+    g_max_files = max_files;
+    /* keep the capture of the last run */
+    if (access(path, F_OK) == 0)
+        shift_files();
+    if (open_file() < 0)
+        return -1;
+    if (!g_writer.joinable()) {
+        g_stop = false;
+        g_writer = thread(writer_loop);
+    }
+    /* exit() is how the server stops, keep the last records. registered
+       after LogInit()'s, so run before it while the log is still written */
+    if (!at_exit) {
+        atexit(capture_at_exit);
+        at_exit = true;
+    }
+    g_enabled = true;
+    LOG_INFO("Capturing one of %d requests into %s", g_sample, path);
+    return 0;
+}
+
+void Capture::Write(Type type, const std::string& name, const VideoDB::QueryParam *param,
+        long arrival_us, const std::vector<uint64_t>& frames)
+{
+    if (!g_enabled.load(memory_order_relaxed)
+            || g_seen.fetch_add(1, memory_order_relaxed) % g_sample != 0)
+        return;
+
+    VideoDB::QueryParam default_param;
+    if (param == nullptr)
+        param = &default_param;
+    long deadline_ms = param->deadline_us ? max((param->deadline_us - arrival_us) / 1000, 1L) : 0;
+
+    string record;
+    record.reserve(48 + name.size() + frames.size() * sizeof(uint64_t));
+    put<uint32_t>(record, 0);
+    put<uint8_t>(record, type);
+    put<int64_t>(record, arrival_us);
+    put<uint32_t>(record, param->limit);
+    put<double>(record, param->min_score);
+    put<int32_t>(record, deadline_ms);
+    put<uint32_t>(record, name.size());
+    record.append(name);
+    put<uint32_t>(record, frames.size());
+    record.append((const char *)frames.data(), frames.size() * sizeof(uint64_t));
+    uint32_t size = record.size() - sizeof(uint32_t);
+    memcpy(&record[0], &size, sizeof(size));
+
+    {
+        lock_guard<mutex> lock(g_queue_mutex);
+        if (g_queued_bytes + record.size() > MAX_QUEUED_BYTES) {
+            g_dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        g_queued_bytes += record.size();
+        g_queue.push_back(std::move(record));
+    }
+    g_queue_cv.notify_one();
+}
+
+void Capture::Close()
+{
+    g_enabled = false;
+    if (!g_writer.joinable())
+        return;
+    {
+        lock_guard<mutex> lock(g_queue_mutex);
+        g_stop = true;
+    }
+    g_queue_cv.notify_one();
+    g_writer.join();
+
+    lock_guard<mutex> lock(g_mutex);
+    if (g_fp)
+        fclose(g_fp);
+    g_fp = nullptr;
+}
+
+Capture::Reader::~Reader()
+{
+    if (fp_)
+        fclose(fp_);
+}
+
+int Capture::Reader::Open(const char *path)
+{
+    if (fp_)
+        fclose(fp_);
+    fp_ = fopen(path, "r");
+    if (fp_ == nullptr)
+        return -1;
+
+    size_t header_size = strlen(FILE_SIG) + 2 * sizeof(int64_t);
+    buf_.resize(header_size);
+    if (fread(&buf_[0], 1, header_size, fp_) != header_size
+            || memcmp(buf_.data(), FILE_SIG, strlen(FILE_SIG)) != 0) {
+        fclose(fp_);
+        fp_ = nullptr;
+        return -1;
+    }
+    const char *p = buf_.data() + strlen(FILE_SIG), *end = buf_.data() + buf_.size();
+    int64_t unix_us = 0, mono_us = 0;
+    get(p, end, unix_us);
+    get(p, end, mono_us);
+    start_unix_us_ = unix_us;
+    start_mono_us_ = mono_us;
+    return 0;
+}
+
+int Capture::Reader::Next(Record& record)
+{
+    uint32_t size;
+    if (fp_ == nullptr)
+        return -1;
+    size_t n = fread(&size, 1, sizeof(size), fp_);
+    if (n == 0)
+        return 0;
+    if (n != sizeof(size))
+        return -1;
+    buf_.resize(size);
+    if (fread(&buf_[0], 1, size, fp_) != size)
+        return -1;
+
+    const char *p = buf_.data(), *end = p + size;
+    uint8_t type;
+    int64_t time_us;
+    uint32_t limit, name_len, frame_num;
+    int32_t deadline_ms;
+    if (!get(p, end, type) || type >= TYPE_NUM || !get(p, end, time_us) || !get(p, end, limit)
+            || !get(p, end, record.param.min_score) || !get(p, end, deadline_ms)
+            || !get(p, end, name_len) || end - p < (long)name_len)
+        return -1;
+    record.name.assign(p, name_len);
+    p += name_len;
+    if (!get(p, end, frame_num) || end - p != (long)(frame_num * sizeof(uint64_t)))
+        return -1;
+    record.frames.resize(frame_num);
+    memcpy(record.frames.data(), p, frame_num * sizeof(uint64_t));
+
+    record.type = (Type)type;
+    record.time_us = time_us;
+    record.param.limit = limit;
+    record.param.deadline_us = 0;
+    record.deadline_ms = deadline_ms;
+    return 1;
+}
+
+
+}
+
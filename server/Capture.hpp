@@ -0,0 +1,94 @@
+#ifndef _CAPTURE_HPP_
+#define _CAPTURE_HPP_
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <VideoDB.hpp>
+
+namespace VideoMatch
+{
+
+
+/* Sampled capture of the requests reaching the match engine, for replay
+   against a VideoDB snapshot by 'replay'.
+
+   One of every 'sample' add, query_duplicate and querykey requests is
+   written, with its arrival time, query options and frames, into a binary
+   file rotated like the log: capture -> capture.1 -> capture.2 ...
+   Records are queued to a writer thread, the request does not wait for
+   the disk, and when the writer is too far behind they are dropped and
+   the number is logged.
+
+   File format, native byte order:
+       char sig[] = FILE_SIG (no '\0')
+       int64_t start_unix_us, start_mono_us    when the file was opened
+       [uint32_t size                          bytes of the record after it
+        uint8_t type
+        int64_t time_us                        arrival, TimeCounter::NowMicroS()
+        uint32_t limit
+        double min_score
+        int32_t deadline_ms                    since arrival, 0 for none
+        uint32_t name_len, char name[name_len] video name or key
+        uint32_t frame_num, uint64_t frames[frame_num]] * records
+*/
+class Capture
+{
+public:
+    enum Type {
+        ADD,
+        QUERY,
+        QUERY_KEY,
+        TYPE_NUM,
+    };
+
+    struct Record
+    {
+        Type type;
+        long time_us;
+        std::string name;
+        VideoDB::QueryParam param;
+        /* the query's own deadline since arrival, 0 for none */
+        long deadline_ms;
+        std::vector<uint64_t> frames;
+    };
+
+    /* reads a capture file back, records in the order written */
+    class Reader
+    {
+        FILE *fp_;
+        std::string buf_;
+        long start_unix_us_;
+        long start_mono_us_;
+    public:
+        Reader() : fp_(nullptr), start_unix_us_(0), start_mono_us_(0) {}
+        ~Reader();
+        /* return -1 if not a capture file */
+        int Open(const char *path);
+        /* return 1 for a record, 0 at the end, -1 if the file is truncated */
+        int Next(Record& record);
+        /* of the file's header, the monotonic clock restarts with the
+           machine: time_us - StartMonoMicroS() + StartUnixMicroS() is the
+           wall time of a record, comparable across files */
+        long StartUnixMicroS() const { return start_unix_us_; }
+        long StartMonoMicroS() const { return start_mono_us_; }
+    };
+
+    static const char *TypeName(Type type);
+
+    /* start capturing into 'path', 'max_bytes' 0 means never rotate */
+    static int Open(const char *path, int sample, long max_bytes, int max_files);
+    /* write what is queued and close the file, at exit() too */
+    static void Close();
+    /* called by every request of the type, only sampled ones are written,
+       'param' is for queries, its deadline is taken relative to 'arrival_us' */
+    static void Write(Type type, const std::string& name, const VideoDB::QueryParam *param,
+            long arrival_us, const std::vector<uint64_t>& frames);
+};
+
+
+}
+
+
+#endif
+
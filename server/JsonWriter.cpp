@@ -0,0 +1,98 @@
+#include <JsonWriter.hpp>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cinttypes>
+
+
+namespace VideoMatch
+{
+
+void JsonWriter::escape(const char *s, size_t len)
+{
+    static const char *HEX = "0123456789abcdef";
+
+    out_.push_back('"');
+    const char *run = s;
+    for(const char *p = s; p < s + len; p++) {
+        unsigned char ch = *p;
+        if (ch >= 0x20 && ch != '"' && ch != '\\')
+            continue;
+        out_.append(run, p - run);
+        run = p + 1;
+        switch(ch) {
+            case '"': out_.append("\\\""); break;
+            case '\\': out_.append("\\\\"); break;
+            case '\n': out_.append("\\n"); break;
+            case '\r': out_.append("\\r"); break;
+            case '\t': out_.append("\\t"); break;
+            default: {
+                char buf[7] = {'\\', 'u', '0', '0', HEX[ch >> 4], HEX[ch & 0xF], 0};
+                out_.append(buf, 6);
+            }
+        }
+    }
+    out_.append(run, s + len - run);
+    out_.push_back('"');
+}
+
+JsonWriter& JsonWriter::Key(const char *key)
+{
+    sep();
+    escape(key, strlen(key));
+    out_.push_back(':');
+    need_comma_ = false;
+    return *this;
+}
+
+JsonWriter& JsonWriter::String(const std::string& value)
+{
+    sep();
+    escape(value.data(), value.size());
+    return *this;
+}
+
+JsonWriter& JsonWriter::String(const char *value)
+{
+    sep();
+    escape(value, strlen(value));
+    return *this;
+}
+
+JsonWriter& JsonWriter::Int(int64_t value)
+{
+    char buf[32];
+    sep();
+    out_.append(buf, snprintf(buf, sizeof(buf), "%" PRId64, value));
+    return *this;
+}
+
+JsonWriter& JsonWriter::UInt(uint64_t value)
+{
+    char buf[32];
+    sep();
+    out_.append(buf, snprintf(buf, sizeof(buf), "%" PRIu64, value));
+    return *this;
+}
+
+JsonWriter& JsonWriter::Double(double value)
+{
+    char buf[32];
+    sep();
+    /* json has no inf/nan */
+    if (!std::isfinite(value))
+        value = 0.0;
+    out_.append(buf, snprintf(buf, sizeof(buf), "%.10g", value));
+    return *this;
+}
+
+JsonWriter& JsonWriter::Bool(bool value)
+{
+    sep();
+    out_.append(value ? "true" : "false");
+    return *this;
+}
+
+
+}
+
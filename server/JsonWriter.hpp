@@ -0,0 +1,54 @@
+#ifndef _JSONWRITER_HPP_
+#define _JSONWRITER_HPP_
+#include <stdint.h>
+#include <string>
+
+namespace VideoMatch
+{
+
+
+/* Compact json serializer appending straight into a string (e.g. the reply),
+   no intermediate DOM. Caller is responsible for a well-formed sequence:
+
+       JsonWriter w(reply);
+       w.BeginObject().Key("code").Int(0).Key("result").BeginArray();
+       ...
+       w.EndArray().EndObject();
+*/
+class JsonWriter
+{
+    std::string& out_;
+    bool need_comma_;
+
+    void sep()
+    {
+        if (need_comma_)
+            out_.push_back(',');
+        need_comma_ = true;
+    }
+
+    void escape(const char *s, size_t len);
+
+public:
+    JsonWriter(std::string& out) : out_(out), need_comma_(false) {}
+
+    JsonWriter& BeginObject() { sep(); out_.push_back('{'); need_comma_ = false; return *this; }
+    JsonWriter& EndObject() { out_.push_back('}'); need_comma_ = true; return *this; }
+    JsonWriter& BeginArray() { sep(); out_.push_back('['); need_comma_ = false; return *this; }
+    JsonWriter& EndArray() { out_.push_back(']'); need_comma_ = true; return *this; }
+
+    JsonWriter& Key(const char *key);
+    JsonWriter& String(const std::string& value);
+    JsonWriter& String(const char *value);
+    JsonWriter& Int(int64_t value);
+    JsonWriter& UInt(uint64_t value);
+    JsonWriter& Double(double value);
+    JsonWriter& Bool(bool value);
+};
+
+
+}
+
+
+#endif
+
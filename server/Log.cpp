@@ -1,62 +1,323 @@
 #include "Log.hpp"
 #include <sys/time.h>
+#include <time.h>
 #include <cstdio>
 #include <cstdlib>
 #include <stdarg.h>
+#include <stdint.h>
 #include <cstring>
 #include <ctype.h>
-#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 
+/* Messages are formatted by the logging thread into its own ring buffer
+   (one producer, one consumer, no lock), a background thread drains all rings
+   in batches, sorts them by time and writes them to the log file it keeps open.
+   A logging thread never waits for disk: when its ring is full,
+   the message is dropped and counted. */
+
 int g_log_level = LTRACE;
 char g_log_path[512] = {0};
 const char *log_level_str[6]={"TRACE","DEBUG","INFO","WARN","ERROR","DUMP",};
-pthread_mutex_t log_mutex;
+
+
+namespace {
+
+/* power of 2 */
+const uint64_t RING_SIZE = 256 * 1024;
+/* longer messages are truncated */
+const int MAX_MSG = 4096;
+const int FLUSH_INTERVAL_MS = 20;
+
+struct RecordHeader
+{
+    uint64_t time_us;
+    uint32_t len;
+};
+
+struct Ring
+{
+    char buf[RING_SIZE];
+    /* bytes written and read since created, head is written by the
+       logging thread only, tail by the flusher only */
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    /* set when the thread exits, the flusher frees the ring once drained */
+    std::atomic<bool> orphan;
+    /* dropped messages already reported, used by the flusher */
+    uint64_t reported;
+
+    Ring() : head(0), tail(0), dropped(0), orphan(false), reported(0) {}
+
+    void copy_in(uint64_t pos, const void *data, size_t len)
+    {
+        size_t off = pos & (RING_SIZE - 1);
+        size_t first = std::min(len, (size_t)(RING_SIZE - off));
+        memcpy(buf + off, data, first);
+        memcpy(buf, (const char *)data + first, len - first);
+    }
+
+    void copy_out(uint64_t pos, void *data, size_t len) const
+    {
+        size_t off = pos & (RING_SIZE - 1);
+        size_t first = std::min(len, (size_t)(RING_SIZE - off));
+        memcpy(data, buf + off, first);
+        memcpy((char *)data + first, buf, len - first);
+    }
+};
+
+struct RingHolder
+{
+    Ring *ring;
+    RingHolder() : ring(nullptr) {}
+    ~RingHolder() { if (ring) ring->orphan = true; }
+};
+
+struct Line
+{
+    uint64_t time_us;
+    size_t offset;
+    size_t len;
+};
+
+std::mutex g_rings_mutex;
+std::vector<Ring *> g_rings;
+thread_local RingHolder t_ring;
+
+/* rotation, 0 bytes means never */
+long g_rotate_bytes = 0;
+int g_rotate_files = 5;
+
+std::atomic<bool> g_running(false);
+std::mutex g_flush_mutex;
+std::condition_variable g_flush_cv;
+bool g_stop = false;
+std::thread g_flusher;
+/* used by the flusher only */
+FILE *g_fp = nullptr;
+long g_file_size = 0;
+
+/* messages before LogInit() or after LogDestroy() are written directly */
+std::mutex g_sync_mutex;
+
+
+Ring *get_ring()
+{
+    if (t_ring.ring == nullptr) {
+        t_ring.ring = new Ring();
+        std::lock_guard<std::mutex> lock(g_rings_mutex);
+        g_rings.push_back(t_ring.ring);
+    }
+    return t_ring.ring;
+}
+
+/* thread safe, the formatted second is cached per thread */
+void log_time(char *buf, size_t size, const struct timeval& tv)
+{
+    static thread_local time_t last_sec = -1;
+    static thread_local char sec_str[32];
+
+    if (tv.tv_sec != last_sec) {
+        struct tm stCurrTime;
+        localtime_r(&tv.tv_sec, &stCurrTime);
+        snprintf(sec_str, sizeof(sec_str), "%02d-%02d %02d:%02d:%02d",
+                stCurrTime.tm_mon+1, stCurrTime.tm_mday,
+                stCurrTime.tm_hour, stCurrTime.tm_min, stCurrTime.tm_sec);
+        last_sec = tv.tv_sec;
+    }
+    snprintf(buf, size, "%s:%03d", sec_str, (int)tv.tv_usec/1000);
+}
+
+void open_file()
+{
+    if (g_log_path[0] == '\0')
+        return;
+    g_fp = fopen(g_log_path, "a");
+    if (g_fp) {
+        fseek(g_fp, 0, SEEK_END);
+        g_file_size = ftell(g_fp);
+    }
+}
+
+/* log -> log.1 -> log.2 ... the oldest is removed */
+void rotate()
+{
+    char from[600], to[600];
+
+    if (g_fp)
+        fclose(g_fp);
+    g_fp = nullptr;
+    if (g_rotate_files > 0) {
+        for(int i = g_rotate_files - 1; i >= 1; i--) {
+            snprintf(from, sizeof(from), "%s.%d", g_log_path, i);
+            snprintf(to, sizeof(to), "%s.%d", g_log_path, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", g_log_path);
+        rename(g_log_path, to);
+    } else {
+        remove(g_log_path);
+    }
+    open_file();
+}
+
+void write_out(const char *data, size_t len)
+{
+    if (g_fp && g_rotate_bytes > 0 && g_file_size > 0
+            && g_file_size + (long)len > g_rotate_bytes)
+        rotate();
+    FILE *fp = g_fp ? g_fp : stderr;
+    fwrite(data, 1, len, fp);
+    g_file_size += len;
+}
+
+/* move everything in the rings to the file, called by the flusher */
+void drain()
+{
+    std::string batch;
+    std::vector<Line> lines;
+    uint64_t dropped = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(g_rings_mutex);
+        for(size_t i = 0; i < g_rings.size(); ) {
+            Ring *r = g_rings[i];
+            /* checked before draining, nothing is written after it is set */
+            bool orphan = r->orphan.load(std::memory_order_acquire);
+            uint64_t tail = r->tail.load(std::memory_order_relaxed);
+            uint64_t head = r->head.load(std::memory_order_acquire);
+            while(tail < head) {
+                RecordHeader rh;
+                r->copy_out(tail, &rh, sizeof(rh));
+                tail += sizeof(rh);
+                lines.push_back(Line{rh.time_us, batch.size(), rh.len});
+                batch.resize(batch.size() + rh.len);
+                r->copy_out(tail, &batch[batch.size() - rh.len], rh.len);
+                tail += rh.len;
+            }
+            r->tail.store(tail, std::memory_order_release);
+
+            uint64_t d = r->dropped.load(std::memory_order_relaxed);
+            dropped += d - r->reported;
+            r->reported = d;
+
+            if (orphan) {
+                delete r;
+                g_rings[i] = g_rings.back();
+                g_rings.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+
+    if (lines.empty() && dropped == 0)
+        return;
+
+    /* each ring is in order already */
+    std::stable_sort(lines.begin(), lines.end(),
+            [](const Line& l1, const Line& l2) { return l1.time_us < l2.time_us; });
+    for(const Line& l : lines)
+        write_out(batch.data() + l.offset, l.len);
+
+    if (dropped) {
+        char buf[128], stime[32];
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        log_time(stime, sizeof(stime), tv);
+        int n = snprintf(buf, sizeof(buf), "[%s][%s] [LogMsg] %llu messages dropped, log rings full\n",
+                stime, log_level_str[LWARN], (unsigned long long)dropped);
+        write_out(buf, n);
+    }
+    if (g_fp)
+        fflush(g_fp);
+}
+
+void flusher()
+{
+    std::unique_lock<std::mutex> lock(g_flush_mutex);
+    open_file();
+    while(!g_stop) {
+        g_flush_cv.wait_for(lock, std::chrono::milliseconds(FLUSH_INTERVAL_MS));
+        drain();
+    }
+    drain();
+    if (g_fp)
+        fclose(g_fp);
+    g_fp = nullptr;
+}
+
+void log_at_exit()
+{
+    LogDestroy();
+}
+
+} //end of namespace
 
 
 int LogInit(const char *log_file, int level)
 {
+    static bool at_exit = false;
+
 	g_log_level=level;
-	pthread_mutex_init(&log_mutex,NULL);
     if (log_file) snprintf(g_log_path, sizeof(g_log_path), "%s", log_file);
     else g_log_path[0] = '\0';
+
+    if (g_running)
+        return 0;
+    g_stop = false;
+    g_flusher = std::thread(flusher);
+    g_running = true;
+    /* exit() is how the server stops, keep what is logged */
+    if (!at_exit) {
+        atexit(log_at_exit);
+        at_exit = true;
+    }
 	return 0;
 }
 
-int LogDestroy()
+int LogSetRotation(long max_bytes, int max_files)
 {
-	pthread_mutex_destroy(&log_mutex);
-	return 0;
+    std::lock_guard<std::mutex> lock(g_flush_mutex);
+    g_rotate_bytes = max_bytes;
+    g_rotate_files = max_files;
+    return 0;
 }
 
-char* LogTime()
+int LogDestroy()
 {
-	static char sTime[32];
-	time_t iCurrTime;
-	struct tm stCurrTime;
-	struct timeval ms;
-
-	time(&iCurrTime);
-	localtime_r(&iCurrTime, &stCurrTime);
-	gettimeofday(&ms,NULL);
-	sprintf(sTime, "%02d-%02d %02d:%02d:%02d:%03d",
-		stCurrTime.tm_mon+1, stCurrTime.tm_mday,
-		stCurrTime.tm_hour, stCurrTime.tm_min, stCurrTime.tm_sec, (int)ms.tv_usec/1000);
-
-	return sTime;
+    if (!g_running.exchange(false))
+        return 0;
+    {
+        std::lock_guard<std::mutex> lock(g_flush_mutex);
+        g_stop = true;
+    }
+    g_flush_cv.notify_one();
+    g_flusher.join();
+	return 0;
 }
 
 
 int LogMsg(int curlevel,const char *sourceName,int sourceLine, const char *functionName, const char *szFormat, ...)
 {
 	va_list ap;
-	FILE *fp = NULL;
     char functionName2[128] = {0};
+    char msg[sizeof(RecordHeader) + MAX_MSG];
+    char stime[32];
+    struct timeval tv;
 
     if (curlevel < g_log_level) return 0;
 
 
-    strncpy(functionName2, functionName, 128);
+    strncpy(functionName2, functionName, 127);
 
     bool find_space = false;
     functionName = &functionName2[0];
@@ -80,39 +341,48 @@ int LogMsg(int curlevel,const char *sourceName,int sourceLine, const char *funct
         }
     }
 
+    gettimeofday(&tv, NULL);
+    log_time(stime, sizeof(stime), tv);
 
-    
-	
-    pthread_mutex_lock(&log_mutex);
-    if (g_log_path[0] == '\0')
-    {
-        fp = stderr;
-    }
-    else if((fp = fopen(g_log_path, "a+")) == NULL)
-    {
-        fp = stderr;
-        //iSize = ftell(fp);
-        //if(iSize > 512 * 1048576)  //Log size no more than 500MB
-        //{
-        //    fclose(fp);
-        //    pthread_mutex_unlock(&log_mutex);
-        //    return 0;
-        //}
-    }
-		
-	fprintf(fp, "[%s][%s] [%s] ", LogTime(), log_level_str[curlevel], functionName);
-	
+    /* format after the room of the header, keep the last byte for '\n' */
+    char *text = msg + sizeof(RecordHeader);
+    int n = snprintf(text, MAX_MSG, "[%s][%s] [%s] ", stime, log_level_str[curlevel], functionName);
+    n = std::min(n, MAX_MSG - 1);
 	va_start(ap, szFormat);
-	vfprintf(fp, szFormat, ap);
+	int m = vsnprintf(text + n, MAX_MSG - n, szFormat, ap);
 	va_end(ap);
+    n = std::min(n + std::max(m, 0), MAX_MSG - 1);
+    text[n++] = '\n';
 
-	fprintf(fp, "\n");
-    if (fp != stderr)
-    {
-	    fclose(fp);
+    if (!g_running) {
+        std::lock_guard<std::mutex> lock(g_sync_mutex);
+        FILE *fp = NULL;
+        if (g_log_path[0] == '\0' || (fp = fopen(g_log_path, "a")) == NULL)
+            fp = stderr;
+        fwrite(text, 1, n, fp);
+        if (fp != stderr)
+            fclose(fp);
+        return 0;
     }
-	
-    pthread_mutex_unlock(&log_mutex);
-	return 0;
-}
 
+    Ring *r = get_ring();
+    RecordHeader rh;
+    rh.time_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    rh.len = n;
+    memcpy(msg, &rh, sizeof(rh));
+
+    size_t size = sizeof(rh) + n;
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    uint64_t tail = r->tail.load(std::memory_order_acquire);
+    if (head + size - tail > RING_SIZE) {
+        r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return -1;
+    }
+    r->copy_in(head, msg, size);
+    r->head.store(head + size, std::memory_order_release);
+
+    /* errors are written soon, and a filling ring is drained early */
+    if (curlevel >= LERROR || head + size - tail > RING_SIZE / 2)
+        g_flush_cv.notify_one();
+    return 0;
+}
@@ -19,10 +19,21 @@ enum LOG_LEVEL
 };
 
 
+/* messages are written to the file by a background thread,
+   LogDestroy() flushes them, it is also called at exit */
 int LogInit(const char *log_file, int level);
+/* when the file grows above max_bytes, it is renamed to log_file.1,
+   keeping max_files old files, max_bytes 0 means no rotation */
+int LogSetRotation(long max_bytes, int max_files);
 int LogMsg(int curlevel,const char *sourceName,int sourceLine,const char *functionName,const char *szFormat, ...);
 int LogDestroy();
 
+extern int g_log_level;
+
+/* arguments are not evaluated if the level is disabled */
+#define LOG_AT(level,format,...) ((level) >= g_log_level ? \
+        LogMsg(level,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__) : 0)
+
 
 #ifdef _LOG_NONE
 #define LOG_TRACE(format,...)
@@ -36,37 +47,37 @@ int LogDestroy();
 
 #ifdef _LOG_DEBUG
 #define LOG_TRACE(format,...)
-#define LOG_DEBUG(format,...) LogMsg(LDEBUG,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_INFO(format,...) LogMsg(LINFO,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_WARN(format,...) LogMsg(LWARN,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_ERROR(format,...) LogMsg(LERROR,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_DUMP(format,...) LogMsg(LDUMP,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
+#define LOG_DEBUG(format,...) LOG_AT(LDEBUG,format,##__VA_ARGS__)
+#define LOG_INFO(format,...) LOG_AT(LINFO,format,##__VA_ARGS__)
+#define LOG_WARN(format,...) LOG_AT(LWARN,format,##__VA_ARGS__)
+#define LOG_ERROR(format,...) LOG_AT(LERROR,format,##__VA_ARGS__)
+#define LOG_DUMP(format,...) LOG_AT(LDUMP,format,##__VA_ARGS__)
 #endif
 
 #ifdef _LOG_INFO
 #define LOG_TRACE(format,...)
 #define LOG_DEBUG(format,...)
-#define LOG_INFO(format,...) LogMsg(LINFO,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_WARN(format,...) LogMsg(LWARN,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_ERROR(format,...) LogMsg(LERROR,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_DUMP(format,...) LogMsg(LDUMP,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
+#define LOG_INFO(format,...) LOG_AT(LINFO,format,##__VA_ARGS__)
+#define LOG_WARN(format,...) LOG_AT(LWARN,format,##__VA_ARGS__)
+#define LOG_ERROR(format,...) LOG_AT(LERROR,format,##__VA_ARGS__)
+#define LOG_DUMP(format,...) LOG_AT(LDUMP,format,##__VA_ARGS__)
 #endif
 
 #ifdef _LOG_WARN
 #define LOG_TRACE(format,...)
 #define LOG_DEBUG(format,...)
 #define LOG_INFO(format,...)
-#define LOG_WARN(format,...) LogMsg(LWARN,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_ERROR(format,...) LogMsg(LERROR,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_DUMP(format,...) LogMsg(LDUMP,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
+#define LOG_WARN(format,...) LOG_AT(LWARN,format,##__VA_ARGS__)
+#define LOG_ERROR(format,...) LOG_AT(LERROR,format,##__VA_ARGS__)
+#define LOG_DUMP(format,...) LOG_AT(LDUMP,format,##__VA_ARGS__)
 #endif
 #ifdef _LOG_ERROR
 #define LOG_TRACE(format,...)
 #define LOG_DEBUG(format,...)
 #define LOG_INFO(format,...)
 #define LOG_WARN(format,...)
-#define LOG_ERROR(format,...) LogMsg(LERROR,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_DUMP(format,...) LogMsg(LDUMP,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
+#define LOG_ERROR(format,...) LOG_AT(LERROR,format,##__VA_ARGS__)
+#define LOG_DUMP(format,...) LOG_AT(LDUMP,format,##__VA_ARGS__)
 #endif
 
 #ifdef _LOG_DUMP
@@ -75,16 +86,16 @@ int LogDestroy();
 #define LOG_INFO(format,...)
 #define LOG_WARN(format,...)
 #define LOG_ERROR(format,...)
-#define LOG_DUMP(format,...) LogMsg(LDUMP,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
+#define LOG_DUMP(format,...) LOG_AT(LDUMP,format,##__VA_ARGS__)
 #endif 
 
 #ifndef LOG_TRACE
-#define LOG_TRACE(format,...) LogMsg(LTRACE,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_DEBUG(format,...) LogMsg(LDEBUG,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_INFO(format,...) LogMsg(LINFO,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_WARN(format,...) LogMsg(LWARN,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_ERROR(format,...) LogMsg(LERROR,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
-#define LOG_DUMP(format,...) LogMsg(LDUMP,__FILE__,__LINE__,__PRETTY_FUNCTION__ ,format,##__VA_ARGS__)
+#define LOG_TRACE(format,...) LOG_AT(LTRACE,format,##__VA_ARGS__)
+#define LOG_DEBUG(format,...) LOG_AT(LDEBUG,format,##__VA_ARGS__)
+#define LOG_INFO(format,...) LOG_AT(LINFO,format,##__VA_ARGS__)
+#define LOG_WARN(format,...) LOG_AT(LWARN,format,##__VA_ARGS__)
+#define LOG_ERROR(format,...) LOG_AT(LERROR,format,##__VA_ARGS__)
+#define LOG_DUMP(format,...) LOG_AT(LDUMP,format,##__VA_ARGS__)
 #endif
 
 
@@ -0,0 +1,329 @@
+#include <Metrics.hpp>
+#include <JsonWriter.hpp>
+#include <TimeCounter.hpp>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+
+namespace {
+
+using VideoMatch::Metrics;
+
+/* 2^SUB_BITS linear sub-buckets per power of 2, values below SUB are exact,
+   values of 2^MAX_EXP us (12 days) or more go to the last bucket */
+static const int SUB_BITS = 3;
+static const int SUB = 1 << SUB_BITS;
+static const int MAX_EXP = 40;
+static const int BUCKETS = SUB + (MAX_EXP - SUB_BITS) * SUB;
+
+/* written by its own thread only, read when scraping */
+struct Shard
+{
+    atomic<uint64_t> buckets[Metrics::HISTOGRAM_NUM][BUCKETS];
+    atomic<uint64_t> sums[Metrics::HISTOGRAM_NUM];
+    atomic<uint64_t> counters[Metrics::COUNTER_NUM];
+};
+
+struct MetricDesc
+{
+    const char *name;
+    const char *labels;
+    const char *help;
+};
+
+static const MetricDesc HISTOGRAM_DESC[Metrics::HISTOGRAM_NUM] = {
+    {"videomatch_stage_duration_seconds", "stage=\"json_parse\"", "Duration of request processing stages"},
+    {"videomatch_stage_duration_seconds", "stage=\"get_candidates\"", nullptr},
+    {"videomatch_stage_duration_seconds", "stage=\"check_candidate\"", nullptr},
+    {"videomatch_stage_duration_seconds", "stage=\"result_sort\"", nullptr},
+    {"videomatch_stage_duration_seconds", "stage=\"serialize\"", nullptr},
+    {"videomatch_stage_duration_seconds", "stage=\"save\"", nullptr},
+    {"videomatch_stage_duration_seconds", "stage=\"load\"", nullptr},
+    {"videomatch_stage_duration_seconds", "stage=\"request_add\"", nullptr},
+    {"videomatch_stage_duration_seconds", "stage=\"request_query\"", nullptr},
+    {"videomatch_lock_wait_seconds", "site=\"add\"", "Time waited for the VideoDB lock"},
+    {"videomatch_lock_wait_seconds", "site=\"query_candidates\"", nullptr},
+    {"videomatch_lock_wait_seconds", "site=\"query_name\"", nullptr},
+    {"videomatch_lock_wait_seconds", "site=\"save\"", nullptr},
+    {"videomatch_lock_wait_seconds", "site=\"load\"", nullptr},
+    {"videomatch_lock_wait_seconds", "site=\"frames_count\"", nullptr},
+    {"videomatch_lock_wait_seconds", "site=\"remove\"", nullptr},
+    {"videomatch_lock_wait_seconds", "site=\"stats\"", nullptr},
+    {"videomatch_lock_hold_seconds", "site=\"add\"", "Time the VideoDB lock was held"},
+    {"videomatch_lock_hold_seconds", "site=\"query_candidates\"", nullptr},
+    {"videomatch_lock_hold_seconds", "site=\"query_name\"", nullptr},
+    {"videomatch_lock_hold_seconds", "site=\"save\"", nullptr},
+    {"videomatch_lock_hold_seconds", "site=\"load\"", nullptr},
+    {"videomatch_lock_hold_seconds", "site=\"frames_count\"", nullptr},
+    {"videomatch_lock_hold_seconds", "site=\"remove\"", nullptr},
+    {"videomatch_lock_hold_seconds", "site=\"stats\"", nullptr},
+};
+
+static const MetricDesc COUNTER_DESC[Metrics::COUNTER_NUM] = {
+    {"videomatch_requests_total", "type=\"add\"", "Posted requests processed"},
+    {"videomatch_requests_total", "type=\"query\"", nullptr},
+    {"videomatch_requests_total", "type=\"bad\"", nullptr},
+    {"videomatch_query_candidates_total", "", "Candidates found by queries"},
+    {"videomatch_query_results_total", "", "Results returned by queries"},
+    {"videomatch_query_partial_total", "", "Queries cut by their deadline"},
+};
+
+static const MetricDesc GAUGE_DESC[Metrics::GAUGE_NUM] = {
+    {"videomatch_videos", "", "Videos in DB"},
+    {"videomatch_frame_table_size", "", "Slots in use of the frame index"},
+};
+
+/* 'le' bounds exported for histograms, in us */
+static const double EXPORT_BOUNDS[] = {
+    10, 25, 50, 100, 250, 500, 1e3, 2.5e3, 5e3, 1e4, 2.5e4, 5e4,
+    1e5, 2.5e5, 5e5, 1e6, 2.5e6, 5e6, 1e7, 3e7, 6e7,
+};
+static const double EXPORT_QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+static mutex g_shards_mutex;
+static vector<Shard *> g_shards;
+static thread_local Shard *t_shard = nullptr;
+static atomic<int64_t> g_gauges[Metrics::GAUGE_NUM];
+
+static Shard *get_shard()
+{
+    if (t_shard == nullptr) {
+        /* value-initialized, all zero. never freed, threads are from the pool */
+        t_shard = new Shard();
+        lock_guard<mutex> lock(g_shards_mutex);
+        g_shards.push_back(t_shard);
+    }
+    return t_shard;
+}
+
+/* only the owner thread writes, a plain add is enough */
+static inline void bump(atomic<uint64_t>& a, uint64_t n)
+{
+    a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline int bucket_of(uint64_t v)
+{
+    if (v < (uint64_t)SUB)
+        return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e >= MAX_EXP)
+        return BUCKETS - 1;
+    int sub = (int)(v >> (e - SUB_BITS)) & (SUB - 1);
+    return SUB + (e - SUB_BITS) * SUB + sub;
+}
+
+static inline void bucket_range(int b, uint64_t& lo, uint64_t& hi)
+{
+    if (b < SUB) {
+        lo = hi = b;
+        return;
+    }
+    int e = (b - SUB) / SUB + SUB_BITS;
+    int sub = (b - SUB) % SUB;
+    lo = (uint64_t)(SUB + sub) << (e - SUB_BITS);
+    hi = lo + ((uint64_t)1 << (e - SUB_BITS)) - 1;
+}
+
+static void write_family_header(string& out, const MetricDesc& d, const char *type)
+{
+    if (d.help)
+        Metrics::WriteHeader(out, d.name, type, d.help);
+}
+
+static void write_histogram(string& out, const MetricDesc& d,
+        const vector<uint64_t>& buckets, uint64_t sum)
+{
+    char name[128], labels[128];
+    uint64_t count = 0;
+    for(auto n : buckets)
+        count += n;
+
+    snprintf(name, sizeof(name), "%s_bucket", d.name);
+    int b = 0;
+    uint64_t cum = 0;
+    for(double bound : EXPORT_BOUNDS) {
+        for(; b < BUCKETS; b++) {
+            uint64_t lo, hi;
+            bucket_range(b, lo, hi);
+            if (hi > bound)
+                break;
+            cum += buckets[b];
+        }
+        snprintf(labels, sizeof(labels), "%s,le=\"%g\"", d.labels, bound / 1e6);
+        Metrics::WriteValue(out, name, labels, (double)cum);
+    }
+    snprintf(labels, sizeof(labels), "%s,le=\"+Inf\"", d.labels);
+    Metrics::WriteValue(out, name, labels, (double)count);
+
+    snprintf(name, sizeof(name), "%s_sum", d.name);
+    Metrics::WriteValue(out, name, d.labels, sum / 1e6);
+    snprintf(name, sizeof(name), "%s_count", d.name);
+    Metrics::WriteValue(out, name, d.labels, (double)count);
+}
+
+/* in us, middle of the bucket where the quantile is */
+static double quantile_of(const vector<uint64_t>& buckets, uint64_t count, double q)
+{
+    uint64_t cum = 0;
+    for(int b = 0; b < BUCKETS && count; b++) {
+        cum += buckets[b];
+        if (cum >= q * count) {
+            uint64_t lo, hi;
+            bucket_range(b, lo, hi);
+            return (lo + hi) / 2.0;
+        }
+    }
+    return 0;
+}
+
+/* quantiles are not part of a Prometheus histogram, exported as gauges */
+static void write_quantiles(string& out, const MetricDesc& d, const vector<uint64_t>& buckets)
+{
+    char name[128], labels[128], help[160];
+    uint64_t count = 0;
+    for(auto n : buckets)
+        count += n;
+
+    snprintf(name, sizeof(name), "%s_quantile", d.name);
+    if (d.help) {
+        snprintf(help, sizeof(help), "Quantiles of %s", d.name);
+        Metrics::WriteHeader(out, name, "gauge", help);
+    }
+    for(double q : EXPORT_QUANTILES) {
+        snprintf(labels, sizeof(labels), "%s,quantile=\"%g\"", d.labels, q);
+        Metrics::WriteValue(out, name, labels, quantile_of(buckets, count, q) / 1e6);
+    }
+}
+
+/* merge a histogram of all shards, return its sum */
+static uint64_t merge_histogram(Metrics::Histogram h, vector<uint64_t>& buckets)
+{
+    uint64_t sum = 0;
+    buckets.assign(BUCKETS, 0);
+    lock_guard<mutex> lock(g_shards_mutex);
+    for(const Shard *s : g_shards) {
+        for(int b = 0; b < BUCKETS; b++)
+            buckets[b] += s->buckets[h][b].load(memory_order_relaxed);
+        sum += s->sums[h].load(memory_order_relaxed);
+    }
+    return sum;
+}
+
+} //end of namespace
+
+
+namespace VideoMatch
+{
+
+Metrics::Timer::Timer(Histogram h)
+    : h_(h), start_us_(TimeCounter::NowMicroS())
+{
+}
+
+Metrics::Timer::~Timer()
+{
+    Observe(h_, TimeCounter::NowMicroS() - start_us_);
+}
+
+void Metrics::Observe(Histogram h, uint64_t us)
+{
+    Shard *s = get_shard();
+    bump(s->buckets[h][bucket_of(us)], 1);
+    bump(s->sums[h], us);
+}
+
+void Metrics::Add(Counter c, uint64_t n)
+{
+    bump(get_shard()->counters[c], n);
+}
+
+void Metrics::Set(Gauge g, int64_t value)
+{
+    g_gauges[g].store(value, memory_order_relaxed);
+}
+
+void Metrics::WriteHeader(string& out, const char *name, const char *type, const char *help)
+{
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void Metrics::WriteValue(string& out, const char *name, const char *labels, double value)
+{
+    char buf[64];
+    out.append(name);
+    if (labels && labels[0])
+        out.append("{").append(labels).append("}");
+    snprintf(buf, sizeof(buf), " %.10g\n", value);
+    out.append(buf);
+}
+
+void Metrics::Scrape(string& out)
+{
+    /* merge shards */
+    vector<vector<uint64_t>> buckets(HISTOGRAM_NUM, vector<uint64_t>(BUCKETS, 0));
+    vector<uint64_t> sums(HISTOGRAM_NUM, 0);
+    vector<uint64_t> counters(COUNTER_NUM, 0);
+    {
+        lock_guard<mutex> lock(g_shards_mutex);
+        for(const Shard *s : g_shards) {
+            for(int h = 0; h < HISTOGRAM_NUM; h++) {
+                for(int b = 0; b < BUCKETS; b++)
+                    buckets[h][b] += s->buckets[h][b].load(memory_order_relaxed);
+                sums[h] += s->sums[h].load(memory_order_relaxed);
+            }
+            for(int c = 0; c < COUNTER_NUM; c++)
+                counters[c] += s->counters[c].load(memory_order_relaxed);
+        }
+    }
+
+    for(int h = 0; h < HISTOGRAM_NUM; h++) {
+        write_family_header(out, HISTOGRAM_DESC[h], "histogram");
+        write_histogram(out, HISTOGRAM_DESC[h], buckets[h], sums[h]);
+    }
+    for(int h = 0; h < HISTOGRAM_NUM; h++)
+        write_quantiles(out, HISTOGRAM_DESC[h], buckets[h]);
+    for(int c = 0; c < COUNTER_NUM; c++) {
+        write_family_header(out, COUNTER_DESC[c], "counter");
+        WriteValue(out, COUNTER_DESC[c].name, COUNTER_DESC[c].labels, (double)counters[c]);
+    }
+    for(int g = 0; g < GAUGE_NUM; g++) {
+        write_family_header(out, GAUGE_DESC[g], "gauge");
+        WriteValue(out, GAUGE_DESC[g].name, GAUGE_DESC[g].labels,
+                (double)g_gauges[g].load(memory_order_relaxed));
+    }
+}
+
+void Metrics::Stat(Histogram h, JsonWriter& writer)
+{
+    vector<uint64_t> buckets;
+    uint64_t sum = merge_histogram(h, buckets);
+    uint64_t count = 0;
+    int max_b = -1;
+    for(int b = 0; b < BUCKETS; b++) {
+        count += buckets[b];
+        if (buckets[b])
+            max_b = b;
+    }
+    uint64_t lo = 0, hi = 0;
+    if (max_b >= 0)
+        bucket_range(max_b, lo, hi);
+
+    writer.BeginObject()
+        .Key("count").UInt(count)
+        .Key("avg_ms").Double(count ? sum / 1000.0 / count : 0)
+        .Key("p50_ms").Double(quantile_of(buckets, count, 0.5) / 1000)
+        .Key("p99_ms").Double(quantile_of(buckets, count, 0.99) / 1000)
+        .Key("max_ms").Double(hi / 1000.0)
+        .EndObject();
+}
+
+
+}
+
@@ -0,0 +1,85 @@
+#ifndef _METRICS_HPP_
+#define _METRICS_HPP_
+#include <stdint.h>
+#include <string>
+
+namespace VideoMatch
+{
+
+class JsonWriter;
+
+/* Low overhead metrics, exported in Prometheus text format.
+
+   Every thread records into its own shard (no lock, no shared cache line),
+   shards are merged when scraped. Histograms are log-linear like HDR histograms:
+   8 linear sub-buckets per power of 2, so quantiles are within 12.5%.
+   Values of histograms are in microseconds. */
+class Metrics
+{
+public:
+    /* call sites of the VideoDB lock, see StatMutex::Site */
+    static const int LOCK_SITE_NUM = 8;
+
+    enum Histogram {
+        H_JSON_PARSE,
+        H_GET_CANDIDATES,
+        H_CHECK_CANDIDATE,
+        H_RESULT_SORT,
+        H_SERIALIZE,
+        H_SAVE,
+        H_LOAD,
+        H_REQUEST_ADD,
+        H_REQUEST_QUERY,
+        /* wait for and hold of the VideoDB lock, in order of StatMutex::Site */
+        H_LOCK_WAIT,
+        H_LOCK_HOLD = H_LOCK_WAIT + LOCK_SITE_NUM,
+        HISTOGRAM_NUM = H_LOCK_HOLD + LOCK_SITE_NUM,
+    };
+
+    enum Counter {
+        C_REQUEST_ADD,
+        C_REQUEST_QUERY,
+        C_REQUEST_BAD,
+        C_QUERY_CANDIDATES,
+        C_QUERY_RESULTS,
+        C_QUERY_PARTIAL,
+        COUNTER_NUM,
+    };
+
+    enum Gauge {
+        G_VIDEOS,
+        G_FRAME_TABLE_SIZE,
+        GAUGE_NUM,
+    };
+
+    /* time a scope into a histogram */
+    class Timer
+    {
+        Histogram h_;
+        long start_us_;
+    public:
+        Timer(Histogram h);
+        ~Timer();
+    };
+
+    static void Observe(Histogram h, uint64_t us);
+    static void Add(Counter c, uint64_t n = 1);
+    static void Set(Gauge g, int64_t value);
+
+    /* append all metrics to 'out' */
+    static void Scrape(std::string& out);
+    /* count, average and quantiles of a histogram in ms, as a json object */
+    static void Stat(Histogram h, JsonWriter& writer);
+
+    /* helpers for other modules exporting their own metrics in Scrape format,
+       'labels' is like 'lane="bulk"' or empty */
+    static void WriteHeader(std::string& out, const char *name, const char *type, const char *help);
+    static void WriteValue(std::string& out, const char *name, const char *labels, double value);
+};
+
+
+}
+
+
+#endif
+
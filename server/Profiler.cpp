@@ -0,0 +1,269 @@
+#include <Profiler.hpp>
+#include <Log.hpp>
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <execinfo.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+using namespace std;
+
+
+namespace {
+
+static const int MAX_DEPTH = 48;
+/* the signal handler and the trampoline it returns to */
+static const int SKIP_FRAMES = 2;
+static const size_t MAX_SAMPLES = 20000;
+
+struct Sample
+{
+    int depth;
+    const char *tag;
+    void *pc[MAX_DEPTH];
+};
+
+struct ProfThread
+{
+    pid_t tid;
+    pthread_t thread;
+};
+
+static mutex g_threads_mutex;
+static vector<ProfThread> g_threads;
+static thread_local bool t_registered = false;
+/* read by the signal handler, plain pointer to a literal */
+static thread_local const char *t_tag = nullptr;
+
+static mutex g_run_mutex;
+/* set by Run() before sampling starts, read by the handlers */
+static atomic<Sample *> g_samples(nullptr);
+static atomic<size_t> g_capacity(0);
+static atomic<size_t> g_next(0);
+static atomic<bool> g_sampling(false);
+/* handlers that may still write a sample: counted before they check
+   g_sampling, so once it is false and this is 0, none will */
+static atomic<int> g_in_handler(0);
+
+static void register_thread()
+{
+    t_registered = true;
+    lock_guard<mutex> lock(g_threads_mutex);
+    g_threads.push_back(ProfThread{(pid_t)syscall(SYS_gettid), pthread_self()});
+}
+
+/* async signal safe, but backtrace() which is loaded before the first signal */
+static void on_sigprof(int, siginfo_t *, void *)
+{
+    int saved_errno = errno;
+    g_in_handler.fetch_add(1);
+    if (g_sampling.load()) {
+        size_t i = g_next.fetch_add(1, memory_order_relaxed);
+        if (i < g_capacity.load(memory_order_relaxed)) {
+            Sample& s = g_samples.load(memory_order_relaxed)[i];
+            s.tag = t_tag;
+            s.depth = backtrace(s.pc, MAX_DEPTH);
+        }
+    }
+    g_in_handler.fetch_sub(1, memory_order_release);
+    errno = saved_errno;
+}
+
+/* function name of a return address, without the arguments */
+static string symbolize(void *pc)
+{
+    Dl_info info;
+    const ElfW(Sym) *sym = nullptr;
+    char buf[64];
+
+    if (dladdr1(pc, &info, (void **)&sym, RTLD_DL_SYMENT) == 0) {
+        snprintf(buf, sizeof(buf), "%p", pc);
+        return buf;
+    }
+    /* a local function is not in the dynamic symbols,
+       do not take it for the exported one before it */
+    if (info.dli_sname == nullptr || sym == nullptr
+            || (char *)pc >= (char *)info.dli_saddr + max((size_t)sym->st_size, (size_t)1)) {
+        const char *module = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+        module = module ? module + 1 : (info.dli_fname ? info.dli_fname : "?");
+        snprintf(buf, sizeof(buf), "+0x%lx", (unsigned long)((char *)pc - (char *)info.dli_fbase));
+        return string(module) + buf;
+    }
+
+    int status;
+    char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    string name = (status == 0 && demangled) ? demangled : info.dli_sname;
+    free(demangled);
+
+    /* cut the arguments, (anonymous namespace) is part of the name */
+    static const char ANON[] = "(anonymous namespace)";
+    size_t pos = 0;
+    while((pos = name.find('(', pos)) != string::npos) {
+        if (name.compare(pos, sizeof(ANON) - 1, ANON) != 0) {
+            name.resize(pos);
+            break;
+        }
+        pos += sizeof(ANON) - 1;
+    }
+    /* ';' separates frames in collapsed stacks */
+    replace(name.begin(), name.end(), ';', ':');
+    return name;
+}
+
+static void collapse(const Sample *samples, size_t num, string& out)
+{
+    unordered_map<void *, string> names;
+    map<string, size_t> stacks;
+    string stack;
+
+    for(size_t i = 0; i < num; i++) {
+        const Sample& s = samples[i];
+        stack = s.tag ? s.tag : "untagged";
+        /* root first */
+        for(int d = s.depth - 1; d >= SKIP_FRAMES; d--) {
+            /* return addresses point after the call */
+            void *pc = (char *)s.pc[d] - (d > SKIP_FRAMES ? 1 : 0);
+            auto it = names.find(pc);
+            if (it == names.end())
+                it = names.insert(make_pair(pc, symbolize(pc))).first;
+            stack.push_back(';');
+            stack.append(it->second);
+        }
+        stacks[stack]++;
+    }
+
+    vector<pair<size_t, const string *>> sorted;
+    for(const auto& st : stacks)
+        sorted.push_back(make_pair(st.second, &st.first));
+    sort(sorted.begin(), sorted.end(),
+            [](const pair<size_t, const string *>& s1, const pair<size_t, const string *>& s2) {
+                return s1.first > s2.first;
+            });
+    for(const auto& st : sorted) {
+        out.append(*st.second);
+        out.append(" ").append(to_string(st.first)).append("\n");
+    }
+}
+
+} //end of namespace
+
+
+namespace VideoMatch
+{
+
+Profiler::Tag::Tag(const char *tag)
+    : prev_(t_tag)
+{
+    if (!t_registered)
+        register_thread();
+    t_tag = tag;
+}
+
+Profiler::Tag::~Tag()
+{
+    t_tag = prev_;
+}
+
+int Profiler::Run(int seconds, int hz, std::string& out)
+{
+    unique_lock<mutex> run_lock(g_run_mutex, try_to_lock);
+    if (!run_lock.owns_lock())
+        return -1;
+
+    vector<ProfThread> threads;
+    {
+        lock_guard<mutex> lock(g_threads_mutex);
+        threads = g_threads;
+    }
+
+    /* loads the unwinder, it may allocate the first time */
+    void *dummy[2];
+    backtrace(dummy, 2);
+
+    size_t capacity = min(MAX_SAMPLES, (size_t)seconds * hz * max(threads.size(), (size_t)1));
+    vector<Sample> samples(capacity);
+    g_samples.store(samples.data(), memory_order_relaxed);
+    g_capacity.store(capacity, memory_order_relaxed);
+    g_next = 0;
+
+    /* installed for good: a SIGPROF still pending after the timers are
+       deleted must not meet the default action, which kills the process,
+       the handler ignores it once sampling stopped. runs are serialized */
+    static bool handler_installed = false;
+    if (!handler_installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = on_sigprof;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, nullptr);
+        handler_installed = true;
+    }
+    g_sampling.store(true);
+
+    /* a CPU time timer per thread, signaling that thread only */
+    vector<timer_t> timers;
+    long interval_ns = 1000000000L / max(hz, 1);
+    for(const auto& t : threads) {
+        clockid_t clock;
+        if (pthread_getcpuclockid(t.thread, &clock) != 0)
+            continue;
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGPROF;
+        sev.sigev_notify_thread_id = t.tid;
+        timer_t timer;
+        if (timer_create(clock, &sev, &timer) != 0)
+            continue;
+        struct itimerspec its;
+        its.it_interval.tv_sec = its.it_value.tv_sec = interval_ns / 1000000000L;
+        its.it_interval.tv_nsec = its.it_value.tv_nsec = interval_ns % 1000000000L;
+        timer_settime(timer, 0, &its, nullptr);
+        timers.push_back(timer);
+    }
+    LOG_INFO("Profiling %d threads for %d s at %d Hz", (int)timers.size(), seconds, hz);
+
+    this_thread::sleep_for(chrono::seconds(seconds));
+
+    for(auto timer : timers)
+        timer_delete(timer);
+    g_sampling.store(false);
+    /* a handler that saw sampling on may be in backtrace() still, on a
+       thread not running, samples is not read nor freed before it is out */
+    while(g_in_handler.load(memory_order_acquire) > 0)
+        this_thread::sleep_for(chrono::milliseconds(1));
+
+    size_t num = min(g_next.load(), capacity);
+    if (g_next > capacity)
+        LOG_INFO("Profiler dropped %d samples", (int)(g_next - capacity));
+    collapse(samples.data(), num, out);
+    g_samples.store(nullptr, memory_order_relaxed);
+    g_capacity.store(0, memory_order_relaxed);
+    return 0;
+}
+
+
+}
+
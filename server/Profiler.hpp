@@ -0,0 +1,43 @@
+#ifndef _PROFILER_HPP_
+#define _PROFILER_HPP_
+#include <string>
+
+namespace VideoMatch
+{
+
+
+/* Sampling CPU profiler, no privilege needed.
+
+   Threads processing requests are registered by their first Tag. While
+   profiling, each of them gets a timer of its own CPU time raising SIGPROF,
+   the handler records the stack and the current Tag of the thread. Other
+   threads (e.g. the network thread) never see the signal.
+   Stacks are symbolized in process (link with -rdynamic for the server's own
+   functions) and returned as collapsed stacks for flamegraph.pl:
+
+       query_duplicate;start_thread;...;VideoMatch::VideoDB::check_candidate 42
+*/
+class Profiler
+{
+public:
+    /* what the thread is doing, until the Tag goes out of scope,
+       'tag' must be a literal */
+    class Tag
+    {
+        const char *prev_;
+    public:
+        Tag(const char *tag);
+        ~Tag();
+    };
+
+    /* sample for 'seconds' at 'hz' per thread CPU second, blocks meanwhile,
+       return -1 if another profile is running */
+    static int Run(int seconds, int hz, std::string& out);
+};
+
+
+}
+
+
+#endif
+
@@ -0,0 +1,420 @@
+#include <RequestParser.hpp>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+
+namespace {
+
+/* nesting limit for skipped values, deeper input is rejected */
+static const int MAX_DEPTH = 64;
+
+struct Cursor
+{
+    const char *p;
+    const char *end;
+};
+
+static inline void skip_ws(Cursor& c)
+{
+    while(c.p < c.end && (*c.p == ' ' || *c.p == '\n' || *c.p == '\r' || *c.p == '\t'))
+        c.p++;
+}
+
+static inline bool expect(Cursor& c, char ch)
+{
+    skip_ws(c);
+    if (c.p >= c.end || *c.p != ch)
+        return false;
+    c.p++;
+    return true;
+}
+
+static int hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+static bool read_hex4(Cursor& c, unsigned int& cp)
+{
+    if (c.end - c.p < 4)
+        return false;
+    cp = 0;
+    for(int i = 0; i < 4; i++) {
+        int h = hex_value(c.p[i]);
+        if (h < 0)
+            return false;
+        cp = (cp << 4) | h;
+    }
+    c.p += 4;
+    return true;
+}
+
+static void append_utf8(string& out, unsigned int cp)
+{
+    if (cp < 0x80) {
+        out.push_back((char)cp);
+    } else if (cp < 0x800) {
+        out.push_back((char)(0xC0 | (cp >> 6)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back((char)(0xE0 | (cp >> 12)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back((char)(0xF0 | (cp >> 18)));
+        out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+/* cursor is at the opening quote, decode into 'out' if not null */
+static bool read_string(Cursor& c, string *out)
+{
+    if (c.p >= c.end || *c.p != '"')
+        return false;
+    c.p++;
+    for(;;) {
+        /* copy the plain run at once, most strings have no escape */
+        const char *s = c.p;
+        while(c.p < c.end && *c.p != '"' && *c.p != '\\')
+            c.p++;
+        if (c.p >= c.end)
+            return false;
+        if (out)
+            out->append(s, c.p - s);
+        if (*c.p == '"') {
+            c.p++;
+            return true;
+        }
+
+        /* escape sequence */
+        c.p++;
+        if (c.p >= c.end)
+            return false;
+        char ch = *c.p++;
+        char decoded;
+        switch(ch) {
+            case '"': decoded = '"'; break;
+            case '\\': decoded = '\\'; break;
+            case '/': decoded = '/'; break;
+            case 'b': decoded = '\b'; break;
+            case 'f': decoded = '\f'; break;
+            case 'n': decoded = '\n'; break;
+            case 'r': decoded = '\r'; break;
+            case 't': decoded = '\t'; break;
+            case 'u': {
+                unsigned int cp;
+                if (!read_hex4(c, cp))
+                    return false;
+                /* surrogate pair */
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    unsigned int lo;
+                    if (c.end - c.p < 6 || c.p[0] != '\\' || c.p[1] != 'u')
+                        return false;
+                    c.p += 2;
+                    if (!read_hex4(c, lo) || lo < 0xDC00 || lo > 0xDFFF)
+                        return false;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                }
+                if (out)
+                    append_utf8(*out, cp);
+                continue;
+            }
+            default:
+                return false;
+        }
+        if (out)
+            out->push_back(decoded);
+    }
+}
+
+/* any json number, value not needed */
+static bool skip_number(Cursor& c)
+{
+    const char *s = c.p;
+    if (c.p < c.end && *c.p == '-')
+        c.p++;
+    const char *digits = c.p;
+    while(c.p < c.end && *c.p >= '0' && *c.p <= '9')
+        c.p++;
+    if (c.p == digits)
+        return false;
+    if (c.p < c.end && *c.p == '.') {
+        c.p++;
+        while(c.p < c.end && *c.p >= '0' && *c.p <= '9')
+            c.p++;
+    }
+    if (c.p < c.end && (*c.p == 'e' || *c.p == 'E')) {
+        c.p++;
+        if (c.p < c.end && (*c.p == '+' || *c.p == '-'))
+            c.p++;
+        while(c.p < c.end && *c.p >= '0' && *c.p <= '9')
+            c.p++;
+    }
+    return c.p > s;
+}
+
+static bool skip_literal(Cursor& c, const char *lit)
+{
+    size_t n = strlen(lit);
+    if ((size_t)(c.end - c.p) < n || memcmp(c.p, lit, n) != 0)
+        return false;
+    c.p += n;
+    return true;
+}
+
+static bool skip_value(Cursor& c, int depth);
+
+static bool skip_container(Cursor& c, int depth, bool is_object)
+{
+    if (depth > MAX_DEPTH)
+        return false;
+    char close = is_object ? '}' : ']';
+    c.p++;
+    skip_ws(c);
+    if (c.p < c.end && *c.p == close) {
+        c.p++;
+        return true;
+    }
+    for(;;) {
+        if (is_object) {
+            skip_ws(c);
+            if (!read_string(c, nullptr) || !expect(c, ':'))
+                return false;
+        }
+        if (!skip_value(c, depth + 1))
+            return false;
+        skip_ws(c);
+        if (c.p >= c.end)
+            return false;
+        if (*c.p == ',') {
+            c.p++;
+            continue;
+        }
+        if (*c.p == close) {
+            c.p++;
+            return true;
+        }
+        return false;
+    }
+}
+
+static bool skip_value(Cursor& c, int depth)
+{
+    skip_ws(c);
+    if (c.p >= c.end)
+        return false;
+    switch(*c.p) {
+        case '"': return read_string(c, nullptr);
+        case '{': return skip_container(c, depth, true);
+        case '[': return skip_container(c, depth, false);
+        case 't': return skip_literal(c, "true");
+        case 'f': return skip_literal(c, "false");
+        case 'n': return skip_literal(c, "null");
+        default: return skip_number(c);
+    }
+}
+
+/* option value: scalar as its text, or array of strings joined by ',',
+   objects and other arrays are skipped and not stored */
+static bool read_arg(Cursor& c, string& out, bool& keep)
+{
+    keep = true;
+    const char *s = c.p;
+    switch(*c.p) {
+        case '"':
+            return read_string(c, &out);
+        case '{':
+            keep = false;
+            return skip_value(c, 1);
+        case '[':
+            c.p++;
+            skip_ws(c);
+            if (c.p < c.end && *c.p == ']') {
+                c.p++;
+                return true;
+            }
+            for(;;) {
+                skip_ws(c);
+                if (c.p >= c.end)
+                    return false;
+                if (*c.p == '"') {
+                    if (!out.empty())
+                        out.push_back(',');
+                    if (!read_string(c, &out))
+                        return false;
+                } else {
+                    keep = false;
+                    if (!skip_value(c, 2))
+                        return false;
+                }
+                skip_ws(c);
+                if (c.p >= c.end)
+                    return false;
+                if (*c.p == ',') {
+                    c.p++;
+                    continue;
+                }
+                if (*c.p == ']') {
+                    c.p++;
+                    return true;
+                }
+                return false;
+            }
+        default:
+            if (!skip_value(c, 1))
+                return false;
+            out.assign(s, c.p - s);
+            return true;
+    }
+}
+
+/* non-negative integer that fits uint64, return false if it is some other
+   kind of number, cursor is then left at the start of it */
+static bool read_uint64(Cursor& c, uint64_t& v)
+{
+    const char *s = c.p;
+    v = 0;
+    while(c.p < c.end && *c.p >= '0' && *c.p <= '9') {
+        uint64_t d = *c.p - '0';
+        if (v > (UINT64_MAX - d) / 10) {
+            c.p = s;
+            return false;
+        }
+        v = v * 10 + d;
+        c.p++;
+    }
+    if (c.p == s || (c.p < c.end && (*c.p == '.' || *c.p == 'e' || *c.p == 'E'))) {
+        c.p = s;
+        return false;
+    }
+    return true;
+}
+
+/* cursor is at '[', frames are appended to 'frames',
+   'valid' is cleared if any element is not an unsigned integer */
+static bool read_frames(Cursor& c, vector<uint64_t>& frames, bool& valid)
+{
+    c.p++;
+    /* one element per comma, counted up to the first ']'
+       so the vector is allocated only once */
+    const char *close = (const char *)memchr(c.p, ']', c.end - c.p);
+    if (close == nullptr)
+        return false;
+    frames.reserve(frames.size() + count(c.p, close, ',') + 1);
+
+    valid = true;
+    skip_ws(c);
+    if (c.p < c.end && *c.p == ']') {
+        c.p++;
+        return true;
+    }
+    for(;;) {
+        skip_ws(c);
+        uint64_t v;
+        if (read_uint64(c, v)) {
+            frames.push_back(v);
+        } else {
+            valid = false;
+            if (!skip_value(c, 1))
+                return false;
+        }
+        skip_ws(c);
+        if (c.p >= c.end)
+            return false;
+        if (*c.p == ',') {
+            c.p++;
+            continue;
+        }
+        if (*c.p == ']') {
+            c.p++;
+            return true;
+        }
+        return false;
+    }
+}
+
+
+} // end of namespace
+
+namespace VideoMatch
+{
+
+int RequestParser::Parse(const char *data, size_t len, ParsedRequest& req)
+{
+    Cursor c = {data, data + len};
+    string key;
+
+    req.clear();
+    if (!expect(c, '{'))
+        return -1;
+    skip_ws(c);
+    if (c.p < c.end && *c.p == '}') {
+        c.p++;
+    } else {
+        for(;;) {
+            skip_ws(c);
+            key.clear();
+            if (!read_string(c, &key) || !expect(c, ':'))
+                return -1;
+            skip_ws(c);
+            if (c.p >= c.end)
+                return -1;
+
+            /* like a DOM parser, the last one wins for duplicate keys */
+            if (key == "type" || key == "name") {
+                bool is_type = key == "type";
+                string& out = is_type ? req.type : req.name;
+                bool& has = is_type ? req.has_type : req.has_name;
+                out.clear();
+                has = (*c.p == '"');
+                if (has ? !read_string(c, &out) : !skip_value(c, 1))
+                    return -1;
+            } else if (key == "frames" || key == "positions") {
+                bool is_frames = key == "frames";
+                vector<uint64_t>& out = is_frames ? req.frames : req.positions;
+                bool& has = is_frames ? req.has_frames : req.has_positions;
+                out.clear();
+                has = (*c.p == '[');
+                if (has ? !read_frames(c, out, has) : !skip_value(c, 1))
+                    return -1;
+            } else {
+                string value;
+                bool keep;
+                if (!read_arg(c, value, keep))
+                    return -1;
+                if (keep)
+                    req.args[key] = value;
+                else
+                    req.args.erase(key);
+            }
+
+            skip_ws(c);
+            if (c.p >= c.end)
+                return -1;
+            if (*c.p == ',') {
+                c.p++;
+                continue;
+            }
+            if (*c.p == '}') {
+                c.p++;
+                break;
+            }
+            return -1;
+        }
+    }
+
+    /* only whitespace allowed after the object */
+    skip_ws(c);
+    return c.p == c.end ? 0 : -1;
+}
+
+
+}
+
@@ -0,0 +1,62 @@
+#ifndef _REQUESTPARSER_HPP_
+#define _REQUESTPARSER_HPP_
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace VideoMatch
+{
+
+
+/* request options by name, from the posted object or from an url query string */
+typedef std::unordered_map<std::string, std::string> ArgMap;
+
+/* fields of a posted request that the match engine cares about,
+   unknown fields are skipped by the parser */
+struct ParsedRequest
+{
+    /* has_xxx is only set when the field exists AND has the expected type */
+    bool has_type;
+    bool has_name;
+    bool has_frames;
+    bool has_positions;
+    std::string type;
+    std::string name;
+    std::vector<uint64_t> frames;
+    /* of the frames in the video, when the client sent some only */
+    std::vector<uint64_t> positions;
+    /* other fields whose value is a string, number or bool (as text),
+       or an array of strings (joined by ',') */
+    ArgMap args;
+
+    ParsedRequest() { clear(); }
+    void clear()
+    {
+        has_type = has_name = has_frames = has_positions = false;
+        type.clear();
+        name.clear();
+        frames.clear();
+        positions.clear();
+        args.clear();
+    }
+};
+
+/* Single pass json parser for the posted request, no DOM is built:
+   frames are written into ParsedRequest::frames (reserved once) while scanning,
+   'type' and 'name' are decoded, scalar options go into 'args',
+   the other values are skipped.
+   Same ParsedRequest can be reused between calls to keep its buffers */
+class RequestParser
+{
+public:
+    /* return 0 if 'data' is a valid json object, -1 otherwise */
+    static int Parse(const char *data, size_t len, ParsedRequest& req);
+};
+
+
+}
+
+
+#endif
+
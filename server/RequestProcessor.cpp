@@ -1,8 +1,234 @@
 #include <RequestProcessor.hpp>
+#include <RequestParser.hpp>
+#include <Capture.hpp>
+#include <SlowLog.hpp>
+#include <JsonWriter.hpp>
+#include <Metrics.hpp>
+#include <Profiler.hpp>
+#include <StatMutex.hpp>
 #include <TimeCounter.hpp>
+#include <Trace.hpp>
 #include <VideoDB.hpp>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <unistd.h>
 
-#include <json/json.h>
+
+namespace {
+
+using VideoMatch::ArgMap;
+using VideoMatch::ParsedRequest;
+using VideoMatch::VideoDB;
+using VideoMatch::JsonWriter;
+using VideoMatch::Metrics;
+using VideoMatch::Profiler;
+using VideoMatch::Trace;
+
+/* fields of each result item */
+enum {
+    FIELD_NAME = 1,
+    FIELD_SCORE = 2,
+    FIELD_ALL = FIELD_NAME | FIELD_SCORE,
+};
+
+/* server default of 'deadline_ms', 0 means no deadline */
+long g_default_deadline_ms = 0;
+
+/* fill query options from request args, deadline counts from 'arrival_us',
+   return nullptr if ok, or the error message */
+const char *parse_query_args(const ArgMap& args, long arrival_us,
+        VideoDB::QueryParam& param, int& fields)
+{
+    fields = FIELD_ALL;
+
+    long deadline_ms = g_default_deadline_ms;
+    auto it = args.find("deadline_ms");
+    if (it != args.end()) {
+        char *end;
+        const char *s = it->second.c_str();
+        deadline_ms = strtol(s, &end, 10);
+        if (*s < '0' || *s > '9' || *end != '\0')
+            return "Bad 'deadline_ms' field";
+    }
+    if (deadline_ms > 0)
+        param.deadline_us = (arrival_us ? arrival_us : TimeCounter::NowMicroS())
+            + deadline_ms * 1000;
+
+    it = args.find("limit");
+    if (it != args.end()) {
+        char *end;
+        const char *s = it->second.c_str();
+        unsigned long limit = strtoul(s, &end, 10);
+        if (*s < '0' || *s > '9' || *end != '\0')
+            return "Bad 'limit' field";
+        param.limit = limit;
+    }
+
+    it = args.find("min_score");
+    if (it != args.end()) {
+        char *end;
+        double min_score = strtod(it->second.c_str(), &end);
+        if (it->second.empty() || *end != '\0' || !std::isfinite(min_score))
+            return "Bad 'min_score' field";
+        param.min_score = min_score;
+    }
+
+    it = args.find("fields");
+    if (it != args.end()) {
+        /* comma separated names */
+        fields = 0;
+        const char *s = it->second.c_str();
+        while(*s) {
+            const char *e = strchr(s, ',');
+            size_t len = e ? e - s : strlen(s);
+            if (len == 4 && strncmp(s, "name", 4) == 0)
+                fields |= FIELD_NAME;
+            else if (len == 5 && strncmp(s, "score", 5) == 0)
+                fields |= FIELD_SCORE;
+            else
+                return "Bad 'fields' field";
+            s += e ? len + 1 : len;
+        }
+        if (fields == 0)
+            return "Bad 'fields' field";
+    }
+    return nullptr;
+}
+
+void write_result(JsonWriter& writer,
+        const std::vector<std::pair<std::string, double>>& result, int fields)
+{
+    writer.Key("result").BeginArray();
+    for(const auto& r : result) {
+        writer.BeginObject();
+        if (fields & FIELD_NAME)
+            writer.Key("name").String(r.first);
+        if (fields & FIELD_SCORE)
+            writer.Key("score").Double(r.second);
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+/* 'trace' option of a request, true or 1 */
+bool trace_wanted(const ArgMap& args)
+{
+    auto it = args.find("trace");
+    return it != args.end() && (it->second == "true" || it->second == "1");
+}
+
+/* 'positions', if sent, one per frame and ascending */
+bool positions_valid(const ParsedRequest& req)
+{
+    if (!req.has_positions)
+        return req.positions.empty();
+    if (req.positions.size() != req.frames.size())
+        return false;
+    for(size_t i = 1; i < req.positions.size(); i++)
+        if (req.positions[i] <= req.positions[i - 1])
+            return false;
+    return true;
+}
+
+/* frames of the video the client hashed, before any were collapsed */
+long video_frames(const ParsedRequest& req)
+{
+    return req.positions.empty() ? (long)req.frames.size() : (long)req.positions.back() + 1;
+}
+
+/* only when the query was cut by its deadline */
+void write_partial(JsonWriter& writer, const VideoDB::QueryStat& stat)
+{
+    if (!stat.partial)
+        return;
+    writer.Key("partial").Bool(true)
+        .Key("unscored").UInt(stat.unscored)
+        .Key("skipped_frames").UInt(stat.skipped_frames);
+}
+
+/* room for one result item, to avoid growing the reply many times */
+const size_t RESULT_ITEM_SIZE = 64;
+
+/* learnt from finished queries, for estimating the cost of coming ones */
+const double EWMA_ALPHA = 0.1;
+std::atomic<double> g_cand_per_frame(0.0);
+std::atomic<double> g_query_frames(0.0);
+
+/* queries of more frames than it are classified as bulk */
+long g_bulk_frames = 3000;
+
+void learn_query(const VideoDB::QueryStat& stat, size_t results)
+{
+    Metrics::Add(Metrics::C_QUERY_CANDIDATES, stat.candidates);
+    Metrics::Add(Metrics::C_QUERY_RESULTS, results);
+    if (stat.partial)
+        Metrics::Add(Metrics::C_QUERY_PARTIAL);
+
+    /* races between workers only lose a sample */
+    double cpf = (double)stat.candidates / std::max(stat.uniq_frames, (size_t)1);
+    g_cand_per_frame = g_cand_per_frame * (1 - EWMA_ALPHA) + cpf * EWMA_ALPHA;
+    g_query_frames = g_query_frames * (1 - EWMA_ALPHA) + stat.frames * EWMA_ALPHA;
+}
+
+/* every candidate is compared frame by frame with the query */
+long query_units(long frames)
+{
+    return frames + (long)(frames * frames * g_cand_per_frame);
+}
+
+/* elements of the "frames" array, other fields are few, but "positions"
+   is as long as it. Every comma of a request without the array */
+long count_frames(const std::string& request)
+{
+    size_t key = request.find("\"frames\"");
+    size_t begin = key == std::string::npos ? key : request.find('[', key);
+    size_t end = begin == std::string::npos ? begin : request.find(']', begin);
+    if (end == std::string::npos)
+        return std::count(request.begin(), request.end(), ',') + 1;
+    return std::count(request.begin() + begin, request.begin() + end, ',') + 1;
+}
+
+/* resident set size of the process, 0 if unknown */
+long rss_bytes()
+{
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr)
+        return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+void write_allocator(JsonWriter& writer)
+{
+    writer.BeginObject();
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    writer.Key("arena").UInt(mi.arena)
+        .Key("mmap").UInt(mi.hblkhd)
+        .Key("in_use").UInt(mi.uordblks)
+        .Key("free").UInt(mi.fordblks)
+        .Key("releasable").UInt(mi.keepcost);
+#elif defined(__GLIBC__)
+    /* fields are int, wrong above 2GB */
+    struct mallinfo mi = mallinfo();
+    writer.Key("arena").UInt((unsigned)mi.arena)
+        .Key("mmap").UInt((unsigned)mi.hblkhd)
+        .Key("in_use").UInt((unsigned)mi.uordblks)
+        .Key("free").UInt((unsigned)mi.fordblks)
+        .Key("releasable").UInt((unsigned)mi.keepcost);
+#endif
+    writer.EndObject();
+}
+
+} //end of namespace
 
 
 namespace VideoMatch
@@ -11,92 +237,140 @@ namespace VideoMatch
 VideoDB* RequestProcessor::vdb_ = nullptr;
 
 
-void RequestProcessor::SetVideoDB(VideoDB *db) 
+void RequestProcessor::SetVideoDB(VideoDB *db)
 {
     vdb_ = db;
 }
 
 
 /*
-    Json format: 
+    Json format:
 Request:
 
     type: string "[add | query_duplicate | query_video | remove]"
     name: string  (when add | query_video | remove)
     frames: array of UInt64 (when add | query_duplicate)
-    
+    positions: array of UInt64, ascending index of each frame in the video,
+               when the client collapsed runs of near identical frames
+               (optional, when add | query_duplicate), checked, not stored
+    limit: int, max number of results, best first (optional, when query_duplicate)
+    deadline_ms: int, time since arrival after which the query stops scoring,
+                 and returns 'partial' result (optional, when query_duplicate)
+    min_score: double, only results scoring above it (optional, when query_duplicate)
+    fields: array of string in [name | score], fields of each result (optional, when query_duplicate)
+    trace: bool, record a trace of the request, see GET /trace (optional)
+
+    other fields are ignored, frames element that is not an unsigned integer
+    makes the 'frames' field invalid, so as for 'positions'
+
 Replay:
-    
+
     code: int 0 or -1;
     msg: string, if code not equal 0
+    result: array of {name, score}, when query_duplicate
+    partial: true if the deadline passed, then
+    unscored: int, number of candidates not scored
+    skipped_frames: int, number of query frames not looked up for candidates
 
 */
 
-void RequestProcessor::Process(const std::string& request, std::string& reply)
+void RequestProcessor::Process(const std::string& request, std::string& reply, long arrival_us)
 {
-    //Parse request , Json
-    Json::Reader reader;
-    Json::StyledWriter writer;
-    Json::Value v;
-    Json::Value rv;
+    //Parse request, no DOM built for posted data
+    ParsedRequest req;
+    JsonWriter writer(reply);
+    Profiler::Tag tag("parse");
 
+    reply.clear();
     auto bad_rpl = [&](const std::string& msg) {
-        rv["code"] = (Json::Value::Int)(-1);
-        rv["msg"] = msg;
-        reply = writer.write(rv);
+        reply.clear();
+        writer.BeginObject().Key("code").Int(-1).Key("msg").String(msg).EndObject();
+        Metrics::Add(Metrics::C_REQUEST_BAD);
     };
-    
-    if (!reader.parse(request.c_str(), v, false)) {
+
+    long parse_start = TimeCounter::NowMicroS();
+    int parsed = RequestParser::Parse(request.data(), request.size(), req);
+    long parse_end = TimeCounter::NowMicroS();
+    Metrics::Observe(Metrics::H_JSON_PARSE, parse_end - parse_start);
+
+    /* tracing starts once the request is known, earlier stages are recorded after */
+    Trace::Request trace_req("RequestProcessor::Process", trace_wanted(req.args),
+            arrival_us ? arrival_us : parse_start);
+    if (arrival_us)
+        Trace::Record("queue_wait", arrival_us, parse_start);
+    Trace::Record("json_parse", parse_start, parse_end);
+    Trace::Span span("process");
+    span.Attr("type", req.type).Attr("bytes", (long)request.size());
+
+    if (parsed < 0) {
         bad_rpl("Parse failed");
         return;
     }
 
-    if (!v.isMember("type") || !v["type"].isString()) {
+    if (!req.has_type) {
         bad_rpl("No 'type' field");
         return;
     }
 
-    const std::string req_type = v["type"].asString();
-    if (req_type == "add") {
-        if (!v.isMember("name") || !v["name"].isString()) {
+    if (req.type == "add") {
+        Profiler::Tag add_tag("add");
+        if (!req.has_name) {
             bad_rpl("No 'name' field");
             return;
         }
-        if (!v.isMember("frames") || !v["frames"].isArray()) {
+        if (!req.has_frames) {
             bad_rpl("No 'frames' field");
             return;
         }
-        VideoDB::DataItem data_item(v["name"].asString());
-        Json::Value& frames = v["frames"];
-        int fc = frames.size();
-        for(int i = 0; i < fc; i++) {
-            data_item.Push(frames[i].asUInt64());
+        if (!positions_valid(req)) {
+            bad_rpl("Bad 'positions' field");
+            return;
         }
-        rv["code"] = vdb_->Add(data_item);
-        reply = writer.write(rv);
+        Metrics::Timer t(Metrics::H_REQUEST_ADD);
+        Metrics::Add(Metrics::C_REQUEST_ADD);
+        span.Attr("name", req.name).Attr("frames", (long)req.frames.size())
+            .Attr("video_frames", video_frames(req));
+        Capture::Write(Capture::ADD, req.name, nullptr, arrival_us ? arrival_us : parse_start, req.frames);
+        VideoDB::DataItem data_item(req.name, std::move(req.frames));
+        writer.BeginObject().Key("code").Int(vdb_->Add(data_item)).EndObject();
 
-    } else if (req_type == "query_duplicate") {
-         if (!v.isMember("frames") || !v["frames"].isArray()) {
+    } else if (req.type == "query_duplicate") {
+        Profiler::Tag query_tag("query_duplicate");
+        if (!req.has_frames) {
             bad_rpl("No 'frames' field");
             return;
         }
-        VideoDB::DataItem data_item("QUERY"); // name actually not required
-        Json::Value& frames = v["frames"];
-        int fc = frames.size();
-        for(int i = 0; i < fc; i++) {
-            data_item.Push(frames[i].asUInt64());
+        if (!positions_valid(req)) {
+            bad_rpl("Bad 'positions' field");
+            return;
+        }
+        span.Attr("frames", (long)req.frames.size()).Attr("video_frames", video_frames(req));
+        VideoDB::QueryParam param;
+        int fields;
+        const char *err = parse_query_args(req.args, arrival_us, param, fields);
+        if (err) {
+            bad_rpl(err);
+            return;
         }
+        Capture::Write(Capture::QUERY, "", &param, arrival_us ? arrival_us : parse_start, req.frames);
+        Metrics::Timer t(Metrics::H_REQUEST_QUERY);
+        Metrics::Add(Metrics::C_REQUEST_QUERY);
+        VideoDB::DataItem data_item("QUERY", std::move(req.frames)); // name actually not required
+        VideoDB::QueryStat stat;
         std::vector<std::pair<std::string, double>> result;
-        rv["code"] = vdb_->Query(data_item, result);
-        for(size_t i = 0; i < result.size(); i++) {
-            Json::Value item;
-            item["name"] = result[i].first;
-            item["score"] = result[i].second;
-            rv["result"][(int)i] = item;
-        }
-        reply = writer.write(rv);
-    //} else if (req_type == "query_video") {
-    //} else if (req_type == "remove") {
+        int code = vdb_->Query(data_item, param, result, &stat);
+        learn_query(stat, result.size());
+        SlowLog::Check("query_duplicate", "", arrival_us ? arrival_us : parse_start, stat, result.size());
+
+        Metrics::Timer ts(Metrics::H_SERIALIZE);
+        Trace::Span serialize_span("serialize");
+        reply.reserve(32 + result.size() * RESULT_ITEM_SIZE);
+        writer.BeginObject().Key("code").Int(code);
+        write_result(writer, result, fields);
+        write_partial(writer, stat);
+        writer.EndObject();
+    //} else if (req.type == "query_video") {
+    //} else if (req.type == "remove") {
     } else {
         bad_rpl("Bad 'type' field");
         return;
@@ -105,62 +379,216 @@ void RequestProcessor::Process(const std::string& request, std::string& reply)
     return;
 }
 
+Admission::Lane RequestProcessor::Estimate(const std::string& request, long& units)
+{
+    long frames = count_frames(request);
+
+    if (request.find("\"query_duplicate\"") != std::string::npos) {
+        units = query_units(frames);
+        return frames > g_bulk_frames ? Admission::BULK : Admission::INTERACTIVE;
+    }
+    /* bad request is classified as add, it will fail fast anyway */
+    units = frames;
+    return Admission::INGEST;
+}
+
+void RequestProcessor::SetBulkFrames(long frames)
+{
+    g_bulk_frames = frames;
+}
+
+void RequestProcessor::SetDefaultDeadline(long deadline_ms)
+{
+    g_default_deadline_ms = deadline_ms;
+}
+
+long RequestProcessor::EstimateQueryKey()
+{
+    return query_units((long)g_query_frames + 1);
+}
+
 void RequestProcessor::SaveDB()
 {
+    Profiler::Tag tag("save");
     vdb_->Save();
 }
 
 void RequestProcessor::Info(std::string& reply)
 {
-    Json::StyledWriter writer;
-    Json::Value rv;
+    JsonWriter writer(reply);
+
+    reply.clear();
+    writer.BeginObject()
+        .Key("video_count").Int(vdb_->Count())
+        .Key("frames_count").Int(vdb_->FramesCount())
+        .Key("frame_table_size").Int(vdb_->FrameTableSize())
+        .Key("admission");
+    Admission::Stat(writer);
+    writer.Key("lock");
+    StatMutex::Stat(writer);
+    writer.EndObject();
+}
+
+void RequestProcessor::Scrape(std::string& reply)
+{
+    reply.clear();
+    Metrics::Set(Metrics::G_VIDEOS, vdb_->Count());
+    Metrics::Set(Metrics::G_FRAME_TABLE_SIZE, vdb_->FrameTableSize());
+    Metrics::Scrape(reply);
+    Admission::Scrape(reply);
+}
+
+void RequestProcessor::IndexStats(std::string& reply)
+{
+    JsonWriter writer(reply);
+    reply.clear();
+    vdb_->IndexStats(writer);
+}
+
+void RequestProcessor::Memory(std::string& reply)
+{
+    JsonWriter writer(reply);
+    long rss = rss_bytes();
+    int videos = vdb_->Count();
+
+    reply.clear();
+    writer.BeginObject().Key("vdb");
+    vdb_->MemoryStats(writer);
+    writer.Key("allocator");
+    write_allocator(writer);
+    writer.Key("rss").Int(rss)
+        .Key("rss_per_video").Double(videos ? (double)rss / videos : 0)
+        .EndObject();
+}
+
+void RequestProcessor::Profile(const ArgMap& args, std::string& reply)
+{
+    static const int MAX_SECONDS = 60;
+    int seconds = 10, hz = 100;
+    auto it = args.find("seconds");
+    if (it != args.end())
+        seconds = atoi(it->second.c_str());
+    it = args.find("hz");
+    if (it != args.end())
+        hz = atoi(it->second.c_str());
 
-    rv["video_count"] = (Json::Value::Int)(vdb_->Count());
-    rv["frames_count"] = (Json::Value::Int)(vdb_->FramesCount());
-    rv["frame_table_size"] = (Json::Value::Int)(vdb_->FrameTableSize());
-    reply = writer.write(rv);
+    reply.clear();
+    if (seconds <= 0 || seconds > MAX_SECONDS || hz <= 0 || hz > 1000) {
+        reply = "Bad 'seconds' or 'hz'\n";
+        return;
+    }
+    if (Profiler::Run(seconds, hz, reply) < 0)
+        reply = "Another profile is running\n";
 }
 
-void RequestProcessor::Query(const std::string& key, std::string& reply, bool plain)
+void RequestProcessor::SlowQueries(std::string& reply)
 {
-    Json::StyledWriter writer;
-    Json::Value rv;
+    reply.clear();
+    SlowLog::Dump(reply);
+}
+
+void RequestProcessor::DumpTrace(std::string& reply)
+{
+    reply.clear();
+    Trace::Dump(reply);
+}
+
+void RequestProcessor::Query(const std::string& key, const ArgMap& args, std::string& reply,
+        bool plain, long arrival_us)
+{
+    JsonWriter writer(reply);
     VideoDB::DataItem data_item(""); // name not required
+    VideoDB::QueryParam param;
     std::vector<std::pair<std::string, double>> result;
+    int fields;
 
     TimeCounter tc;
+    Profiler::Tag tag(plain ? "querykeyplain" : "querykey");
+    long start_us = arrival_us ? arrival_us : TimeCounter::NowMicroS();
+    Trace::Request trace_req("RequestProcessor::Query", trace_wanted(args), arrival_us);
+    if (arrival_us)
+        Trace::Record("queue_wait", arrival_us, TimeCounter::NowMicroS());
+    Trace::Span span("query_key");
+    span.Attr("key", key);
 
     reply.clear();
+    const char *err = parse_query_args(args, arrival_us, param, fields);
+    if (err) {
+        if (!plain)
+            writer.BeginObject().Key("code").Int(-1).Key("msg").String(err).EndObject();
+        return;
+    }
+    Capture::Write(Capture::QUERY_KEY, key, &param, start_us, std::vector<uint64_t>());
+
     if (vdb_->Query(key, data_item) < 0) {
-        if (plain) {
-            return;
-        }
-        rv["code"] = (Json::Value::Int)(-1);
-        rv["msg"] = "Key not found";
-    } else {
-        rv["code"] = vdb_->Query(data_item, result);
-        for(size_t i = 0; i < result.size(); i++) {
-            Json::Value item;
-            if (plain) {
-                char buf[128];
-                snprintf(buf, 128, "%s %s %f\n", key.c_str(), result[i].first.c_str(), result[i].second);
-                reply.append(buf);
-            } else {
-                item["name"] = result[i].first;
-                item["score"] = result[i].second;
-                rv["result"][(int)i] = item;
-            }
-        }
         if (!plain)
-            rv["time_ms"] = (Json::Value::Int)tc.GetTimeMilliS();
+            writer.BeginObject().Key("code").Int(-1).Key("msg").String("Key not found").EndObject();
+        return;
     }
 
-    if (plain) return;
+    VideoDB::QueryStat stat;
+    int code = vdb_->Query(data_item, param, result, &stat);
+    learn_query(stat, result.size());
+    SlowLog::Check(plain ? "querykeyplain" : "querykey", key, start_us, stat, result.size());
+
+    Metrics::Timer ts(Metrics::H_SERIALIZE);
+    Trace::Span serialize_span("serialize");
+    if (plain) {
+        for(size_t i = 0; i < result.size(); i++) {
+            char buf[128];
+            snprintf(buf, 128, "%s %s %f\n", key.c_str(), result[i].first.c_str(), result[i].second);
+            reply.append(buf);
+        }
+        return;
+    }
 
-    reply = writer.write(rv);
+    reply.reserve(64 + result.size() * RESULT_ITEM_SIZE);
+    writer.BeginObject().Key("code").Int(code);
+    write_result(writer, result, fields);
+    write_partial(writer, stat);
+    writer.Key("time_ms").Int(tc.GetTimeMilliS());
+    writer.EndObject();
 }
 
 
 }
 
+#ifdef ESTIMATETEST
+/* estimate_test
+   checks that a query with "positions" is costed as the same without */
+static std::string make_query(int frames, bool positions)
+{
+    std::string req = "{\"type\":\"query_duplicate\",\"limit\":10,\"frames\":[";
+    for(int i = 0; i < frames; i++)
+        req += (i ? "," : "") + std::to_string(0x1234567890abcdefULL + i);
+    req += "]";
+    if (positions) {
+        req += ",\"positions\":[";
+        for(int i = 0; i < frames; i++)
+            req += (i ? "," : "") + std::to_string(i * 3);
+        req += "]";
+    }
+    return req + "}";
+}
+
+using namespace VideoMatch;
 
+int main()
+{
+    int failed = 0;
+    /* as learnt from finished queries, for the squared term of the cost */
+    g_cand_per_frame = 0.5;
+    const int sizes[] = {1, 10, 1000, 2000, 3000, 3001};
+    for(int frames : sizes) {
+        long units, pos_units;
+        Admission::Lane lane = RequestProcessor::Estimate(make_query(frames, false), units);
+        Admission::Lane pos_lane = RequestProcessor::Estimate(make_query(frames, true), pos_units);
+        bool ok = units == pos_units && lane == pos_lane
+                && lane == (frames > g_bulk_frames ? Admission::BULK : Admission::INTERACTIVE);
+        printf("frames=%d units=%ld positions_units=%ld lane=%d positions_lane=%d %s\n",
+                frames, units, pos_units, lane, pos_lane, ok ? "ok" : "FAILED");
+        failed += !ok;
+    }
+    return failed ? 1 : 0;
+}
+#endif
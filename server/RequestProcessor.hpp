@@ -1,6 +1,8 @@
 #ifndef _REQUESTPROCESSOR_HPP_
 #define _REQUESTPROCESSOR_HPP_
 #include <string>
+#include <RequestParser.hpp>
+#include <Admission.hpp>
 
 namespace VideoMatch
 {
@@ -16,14 +18,40 @@ class RequestProcessor
 public:
     static void SetVideoDB(VideoDB *vdb);
     /* query by frames, add new video are called by HTTP Post, 
-       'request' stands for posted data */
-    static void Process(const std::string& request, std::string& reply);
+       'request' stands for posted data,
+       'arrival_us' (by TimeCounter::NowMicroS()) is where deadline counts from, 0 for now */
+    static void Process(const std::string& request, std::string& reply, long arrival_us = 0);
+
+    /* classify posted data into a lane and estimate its cost in Admission units,
+       cheap enough to be called in the network thread */
+    static Admission::Lane Estimate(const std::string& request, long& units);
+    /* queries of more frames go to the bulk lane */
+    static void SetBulkFrames(long frames);
+    /* deadline of queries not giving 'deadline_ms', 0 means no deadline */
+    static void SetDefaultDeadline(long deadline_ms);
+    /* cost of a query by key, the key's frames are not looked up */
+    static long EstimateQueryKey();
 
     /* return status of VDB */
     static void Info(std::string& reply);
+    /* return metrics in Prometheus text format */
+    static void Scrape(std::string& reply);
+    /* return the shape of the frame index, see VideoDB::IndexStats() */
+    static void IndexStats(std::string& reply);
+    /* return memory used by VDB structures, the allocator and the process */
+    static void Memory(std::string& reply);
+    /* sample CPU of the worker threads, return collapsed stacks,
+       'args' may set 'seconds' (default 10) and 'hz' (default 100) */
+    static void Profile(const ArgMap& args, std::string& reply);
+    /* return recent slow queries, see SlowLog */
+    static void SlowQueries(std::string& reply);
+    /* return recent traces as Chrome trace JSON */
+    static void DumpTrace(std::string& reply);
     
-    /* query duplicate video by key, the 'key' has to exist in VDB */
-    static void Query(const std::string& key, std::string& reply, bool plain);
+    /* query duplicate video by key, the 'key' has to exist in VDB,
+       'args' takes the same query options as posted query_duplicate */
+    static void Query(const std::string& key, const ArgMap& args, std::string& reply,
+            bool plain, long arrival_us = 0);
 
     /* save the snapshot of current state into a file */
     static void SaveDB();
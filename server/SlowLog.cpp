@@ -0,0 +1,102 @@
+#include <SlowLog.hpp>
+#include <JsonWriter.hpp>
+#include <TimeCounter.hpp>
+#include <Log.hpp>
+#include <ctime>
+#include <deque>
+#include <mutex>
+
+using namespace std;
+
+
+namespace {
+
+using VideoMatch::VideoDB;
+
+struct SlowQuery
+{
+    time_t time;
+    const char *type;
+    string key;
+    long total_us;
+    VideoDB::QueryStat stat;
+    size_t results;
+};
+
+static const size_t MAX_RECORDS = 256;
+
+static long g_threshold_us = 1000 * 1000;
+static mutex g_mutex;
+static deque<SlowQuery> g_records;
+
+} //end of namespace
+
+
+namespace VideoMatch
+{
+
+void SlowLog::SetThreshold(long ms)
+{
+    lock_guard<mutex> lock(g_mutex);
+    g_threshold_us = ms * 1000;
+}
+
+void SlowLog::Check(const char *type, const std::string& key, long arrival_us,
+        const VideoDB::QueryStat& stat, size_t results)
+{
+    long total_us = TimeCounter::NowMicroS() - arrival_us;
+    lock_guard<mutex> lock(g_mutex);
+    if (g_threshold_us <= 0 || total_us < g_threshold_us)
+        return;
+
+    g_records.push_back(SlowQuery{time(NULL), type, key, total_us, stat, results});
+    if (g_records.size() > MAX_RECORDS)
+        g_records.pop_front();
+    LOG_INFO("Slow %s query %s: %ld ms, %d frames, %d candidates, %d results",
+            type, key.c_str(), total_us / 1000, (int)stat.frames, (int)stat.candidates, (int)results);
+}
+
+void SlowLog::Dump(std::string& out)
+{
+    JsonWriter writer(out);
+    lock_guard<mutex> lock(g_mutex);
+    writer.BeginObject()
+        .Key("threshold_ms").Int(g_threshold_us / 1000)
+        .Key("queries").BeginArray();
+    for(auto it = g_records.rbegin(); it != g_records.rend(); ++it) {
+        const SlowQuery& q = *it;
+        char stime[32];
+        struct tm tm;
+        localtime_r(&q.time, &tm);
+        strftime(stime, sizeof(stime), "%Y-%m-%d %H:%M:%S", &tm);
+
+        writer.BeginObject()
+            .Key("time").String(stime)
+            .Key("type").String(q.type)
+            .Key("key").String(q.key)
+            .Key("total_ms").Double(q.total_us / 1000.0)
+            .Key("frames").UInt(q.stat.frames)
+            .Key("uniq_frames").UInt(q.stat.uniq_frames)
+            .Key("candidates").UInt(q.stat.candidates)
+            .Key("results").UInt(q.results)
+            .Key("partial").Bool(q.stat.partial)
+            .Key("lock_wait_ms").Double(q.stat.lock_wait_us / 1000.0)
+            .Key("get_candidates_ms").Double(q.stat.candidates_us / 1000.0)
+            .Key("check_ms").Double(q.stat.check_us / 1000.0)
+            .Key("slowest").BeginArray();
+        for(const auto& c : q.stat.slowest) {
+            writer.BeginObject()
+                .Key("name").String(c.name)
+                .Key("frames").UInt(c.frames)
+                .Key("check_ms").Double(c.check_us / 1000.0)
+                .Key("score").Double(c.score)
+                .EndObject();
+        }
+        writer.EndArray().EndObject();
+    }
+    writer.EndArray().EndObject();
+}
+
+
+}
+
@@ -0,0 +1,32 @@
+#ifndef _SLOWLOG_HPP_
+#define _SLOWLOG_HPP_
+#include <VideoDB.hpp>
+#include <string>
+
+namespace VideoMatch
+{
+
+
+/* Queries slower than a threshold, with what they went through
+   (VideoDB::QueryStat), kept in a bounded ring for GET /slowqueries.
+   Latency counts from the arrival of the request, queue wait included. */
+class SlowLog
+{
+public:
+    /* 0 disables the log */
+    static void SetThreshold(long ms);
+
+    /* keep the query if it is slow, 'key' is the video queried by key, or empty */
+    static void Check(const char *type, const std::string& key, long arrival_us,
+            const VideoDB::QueryStat& stat, size_t results);
+
+    /* append kept queries as json, latest first */
+    static void Dump(std::string& out);
+};
+
+
+}
+
+
+#endif
+
@@ -0,0 +1,71 @@
+#include <StatMutex.hpp>
+#include <JsonWriter.hpp>
+#include <TimeCounter.hpp>
+#include <Trace.hpp>
+#include <Log.hpp>
+#include <atomic>
+
+using namespace std;
+
+
+namespace {
+
+static atomic<long> g_hold_log_us(0);
+
+} //end of namespace
+
+
+namespace VideoMatch
+{
+
+StatMutex::Lock::Lock(StatMutex& m, Site site)
+    : m_(m), site_(site)
+{
+    long start = TimeCounter::NowMicroS();
+    m_.mutex_.lock();
+    acquired_us_ = TimeCounter::NowMicroS();
+    wait_us_ = acquired_us_ - start;
+    Metrics::Observe((Metrics::Histogram)(Metrics::H_LOCK_WAIT + site_), wait_us_);
+    Trace::Record("lock_wait", start, acquired_us_);
+}
+
+StatMutex::Lock::~Lock()
+{
+    long hold_us = TimeCounter::NowMicroS() - acquired_us_;
+    m_.mutex_.unlock();
+    Metrics::Observe((Metrics::Histogram)(Metrics::H_LOCK_HOLD + site_), hold_us);
+    long threshold = g_hold_log_us.load(memory_order_relaxed);
+    if (threshold > 0 && hold_us > threshold)
+        LOG_WARN("VideoDB lock held by %s for %ld ms", SiteName(site_), hold_us / 1000);
+}
+
+const char *StatMutex::SiteName(Site site)
+{
+    static const char *names[SITE_NUM] = {
+        "add", "query_candidates", "query_name", "save", "load", "frames_count", "remove",
+        "stats",
+    };
+    return names[site];
+}
+
+void StatMutex::SetHoldLogThreshold(long ms)
+{
+    g_hold_log_us = ms * 1000;
+}
+
+void StatMutex::Stat(JsonWriter& writer)
+{
+    writer.BeginObject();
+    for(int i = 0; i < SITE_NUM; i++) {
+        writer.Key(SiteName((Site)i)).BeginObject().Key("wait");
+        Metrics::Stat((Metrics::Histogram)(Metrics::H_LOCK_WAIT + i), writer);
+        writer.Key("hold");
+        Metrics::Stat((Metrics::Histogram)(Metrics::H_LOCK_HOLD + i), writer);
+        writer.EndObject();
+    }
+    writer.EndObject();
+}
+
+
+}
+
@@ -0,0 +1,61 @@
+#ifndef _STATMUTEX_HPP_
+#define _STATMUTEX_HPP_
+#include <Metrics.hpp>
+#include <mutex>
+
+namespace VideoMatch
+{
+
+
+class JsonWriter;
+
+/* Mutex recording, per call site, the time waited for it and the time it
+   was held, into Metrics histograms. Holders longer than the threshold
+   of SetHoldLogThreshold() are logged. */
+class StatMutex
+{
+public:
+    enum Site {
+        ADD,
+        QUERY_CANDIDATES,
+        QUERY_NAME,
+        SAVE,
+        LOAD,
+        FRAMES_COUNT,
+        REMOVE,
+        STATS,
+        SITE_NUM,
+    };
+
+    /* scoped lock, like lock_guard */
+    class Lock
+    {
+        StatMutex& m_;
+        Site site_;
+        long acquired_us_;
+        long wait_us_;
+    public:
+        Lock(StatMutex& m, Site site);
+        ~Lock();
+
+        long WaitMicroS() const { return wait_us_; }
+    };
+
+    static const char *SiteName(Site site);
+    /* 0 means no logging */
+    static void SetHoldLogThreshold(long ms);
+    /* wait and hold time of each site, as a json object */
+    static void Stat(JsonWriter& writer);
+
+private:
+    std::mutex mutex_;
+};
+
+static_assert(StatMutex::SITE_NUM == Metrics::LOCK_SITE_NUM, "lock sites of Metrics");
+
+
+}
+
+
+#endif
+
@@ -0,0 +1,83 @@
+#include <SyntheticCorpus.hpp>
+#include <algorithm>
+
+using namespace std;
+
+
+namespace VideoMatch
+{
+
+SyntheticCorpus::SyntheticCorpus(uint64_t seed, const Shape& shape)
+    : rng_(seed), shape_(shape)
+{
+}
+
+/* plain modulo and shifts, not the std distributions,
+   so a seed gives the same corpus with any standard library */
+size_t SyntheticCorpus::Uniform(size_t n)
+{
+    return n ? rng_() % n : 0;
+}
+
+double SyntheticCorpus::Real()
+{
+    return (rng_() >> 11) * (1.0 / (1ULL << 53));
+}
+
+uint64_t SyntheticCorpus::flip(uint64_t frame, int bits)
+{
+    uint64_t mask = 0;
+    bits = min(bits, 64);
+    while(__builtin_popcountll(mask) < bits)
+        mask |= 1ULL << Uniform(64);
+    return frame ^ mask;
+}
+
+vector<uint64_t> SyntheticCorpus::Video()
+{
+    size_t span = shape_.max_frames > shape_.min_frames ? shape_.max_frames - shape_.min_frames : 0;
+    return Video(shape_.min_frames + Uniform(span + 1));
+}
+
+vector<uint64_t> SyntheticCorpus::Video(size_t frames)
+{
+    vector<uint64_t> video;
+    video.reserve(frames);
+    uint64_t frame = rng_();
+    for(size_t i = 0; i < frames; i++) {
+        if (i > 0 && Real() >= shape_.repeat)
+            frame = Real() < shape_.cut ? rng_() : flip(frame, shape_.step_bits);
+        video.push_back(frame);
+    }
+    return video;
+}
+
+vector<uint64_t> SyntheticCorpus::NearDuplicate(const vector<uint64_t>& src, int k_bits, double ratio)
+{
+    vector<uint64_t> video(src);
+    if (k_bits <= 0)
+        return video;
+    for(auto& frame : video)
+        if (Real() < ratio)
+            frame = flip(frame, k_bits);
+    return video;
+}
+
+vector<uint64_t> SyntheticCorpus::InsertClip(const vector<uint64_t>& host,
+        const vector<uint64_t>& clip, size_t start, size_t len, size_t pos)
+{
+    start = min(start, clip.size());
+    len = min(len, clip.size() - start);
+    pos = min(pos, host.size());
+
+    vector<uint64_t> video;
+    video.reserve(host.size() + len);
+    video.insert(video.end(), host.begin(), host.begin() + pos);
+    video.insert(video.end(), clip.begin() + start, clip.begin() + start + len);
+    video.insert(video.end(), host.begin() + pos, host.end());
+    return video;
+}
+
+
+}
+
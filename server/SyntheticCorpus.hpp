@@ -0,0 +1,66 @@
+#ifndef _SYNTHETICCORPUS_HPP_
+#define _SYNTHETICCORPUS_HPP_
+#include <stdint.h>
+#include <random>
+#include <vector>
+
+namespace VideoMatch
+{
+
+
+/* Synthetic videos of pHash frames, the same for the same seed,
+   for benchmarks and evaluation without a real video collection.
+
+   A video is a random walk of scenes: a scene repeats one hash for some
+   frames, as a still shot does, the next scene differs from it by a few
+   bits, and sometimes a cut jumps to a random hash.
+   Queries are derived from videos: near duplicates with k bits of noise,
+   and clips of one video inserted into another. */
+class SyntheticCorpus
+{
+public:
+    struct Shape
+    {
+        size_t min_frames;
+        size_t max_frames;
+        /* probability that a frame repeats the one before */
+        double repeat;
+        /* bits flipped from a scene to the next */
+        int step_bits;
+        /* probability that a new scene is a cut */
+        double cut;
+
+        Shape() : min_frames(300), max_frames(3000), repeat(0.5), step_bits(3), cut(0.05) {}
+    };
+
+    explicit SyntheticCorpus(uint64_t seed, const Shape& shape = Shape());
+
+    /* a video of random length within the shape */
+    std::vector<uint64_t> Video();
+    std::vector<uint64_t> Video(size_t frames);
+
+    /* copy of 'src' with 'k_bits' random bits flipped in about 'ratio' of the frames */
+    std::vector<uint64_t> NearDuplicate(const std::vector<uint64_t>& src, int k_bits, double ratio = 1.0);
+
+    /* 'host' with frames [start, start + len) of 'clip' inserted before frame 'pos' */
+    static std::vector<uint64_t> InsertClip(const std::vector<uint64_t>& host,
+            const std::vector<uint64_t>& clip, size_t start, size_t len, size_t pos);
+
+    /* random integer in [0, n) */
+    size_t Uniform(size_t n);
+    /* random double in [0, 1) */
+    double Real();
+
+private:
+    std::mt19937_64 rng_;
+    Shape shape_;
+
+    uint64_t flip(uint64_t frame, int bits);
+};
+
+
+}
+
+
+#endif
+
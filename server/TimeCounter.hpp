@@ -1,25 +1,31 @@
 #ifndef _TIMECOUNTER_HPP_
 #define _TIMECOUNTER_HPP_
-#include <sys/time.h>
+#include <time.h>
 
+/* intervals by the monotonic clock, not affected by setting the system time */
 class TimeCounter
 {
 public:
     TimeCounter() {reset();}
     ~TimeCounter() {}
-    void reset() { gettimeofday(&_start, NULL); }
+    void reset() { _start = NowMicroS(); }
     long GetTimeMilliS() {return get_interval()/1000;}
     long GetTimeMicroS() {return get_interval();}
     long GetTimeS() {return get_interval()/1000000;}
+
+    /* monotonic clock, for deadlines and intervals between threads */
+    static long NowMicroS()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
 private:
     long get_interval()
     {
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        return (long)(now.tv_sec - _start.tv_sec)*1000000
-            + now.tv_usec - _start.tv_usec;
+        return NowMicroS() - _start;
     }
-    struct timeval _start;
+    long _start;
 };
 
 
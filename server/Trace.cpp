@@ -0,0 +1,215 @@
+#include <Trace.hpp>
+#include <JsonWriter.hpp>
+#include <TimeCounter.hpp>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+
+namespace {
+
+enum AttrType {
+    ATTR_LONG,
+    ATTR_DOUBLE,
+    ATTR_STRING,
+};
+
+struct TraceAttr
+{
+    const char *key;
+    AttrType type;
+    long l;
+    double d;
+    string s;
+};
+
+struct TraceEvent
+{
+    const char *name;
+    long start_us;
+    long dur_us;
+    vector<TraceAttr> attrs;
+};
+
+struct TraceData
+{
+    uint64_t id;
+    int tid;
+    /* events[0] is the request itself */
+    vector<TraceEvent> events;
+    size_t dropped;
+};
+
+/* a request with a huge number of candidates stops recording spans */
+static const size_t MAX_EVENTS = 8192;
+static const size_t MAX_TRACES = 32;
+
+static atomic<int> g_sample_one_in(0);
+static atomic<uint64_t> g_requests(0);
+static atomic<uint64_t> g_next_id(1);
+static atomic<int> g_next_tid(1);
+
+static mutex g_traces_mutex;
+static deque<unique_ptr<TraceData>> g_traces;
+
+static thread_local TraceData *t_trace = nullptr;
+static thread_local int t_tid = 0;
+
+static int add_event(const char *name, long start_us, long dur_us)
+{
+    if (t_trace->events.size() >= MAX_EVENTS) {
+        t_trace->dropped++;
+        return -1;
+    }
+    t_trace->events.push_back(TraceEvent{name, start_us, dur_us, {}});
+    return (int)t_trace->events.size() - 1;
+}
+
+static TraceAttr& add_attr(int index, const char *key, AttrType type)
+{
+    auto& attrs = t_trace->events[index].attrs;
+    attrs.push_back(TraceAttr{key, type, 0, 0.0, string()});
+    return attrs.back();
+}
+
+static void write_event(VideoMatch::JsonWriter& writer, const TraceData& td, const TraceEvent& ev)
+{
+    writer.BeginObject()
+        .Key("name").String(ev.name)
+        .Key("cat").String("videomatch")
+        .Key("ph").String("X")
+        .Key("ts").Int(ev.start_us)
+        .Key("dur").Int(ev.dur_us)
+        .Key("pid").Int(1)
+        .Key("tid").Int(td.tid)
+        .Key("args").BeginObject()
+        .Key("trace_id").UInt(td.id);
+    for(const auto& a : ev.attrs) {
+        writer.Key(a.key);
+        if (a.type == ATTR_LONG)
+            writer.Int(a.l);
+        else if (a.type == ATTR_DOUBLE)
+            writer.Double(a.d);
+        else
+            writer.String(a.s);
+    }
+    writer.EndObject().EndObject();
+}
+
+} //end of namespace
+
+
+namespace VideoMatch
+{
+
+Trace::Request::Request(const char *name, bool enabled, long start_us)
+    : active_(false)
+{
+    /* nested requests belong to the outer one */
+    if (t_trace)
+        return;
+    int one_in = g_sample_one_in.load(memory_order_relaxed);
+    if (!enabled && (one_in <= 0 || g_requests++ % one_in != 0))
+        return;
+
+    if (t_tid == 0)
+        t_tid = g_next_tid++;
+    active_ = true;
+    t_trace = new TraceData();
+    t_trace->id = g_next_id++;
+    t_trace->tid = t_tid;
+    t_trace->dropped = 0;
+    add_event(name, start_us ? start_us : TimeCounter::NowMicroS(), 0);
+}
+
+Trace::Request::~Request()
+{
+    if (!active_)
+        return;
+
+    TraceEvent& root = t_trace->events[0];
+    root.dur_us = TimeCounter::NowMicroS() - root.start_us;
+    if (t_trace->dropped) {
+        TraceAttr& a = add_attr(0, "dropped_spans", ATTR_LONG);
+        a.l = t_trace->dropped;
+    }
+
+    unique_ptr<TraceData> td(t_trace);
+    t_trace = nullptr;
+    lock_guard<mutex> lock(g_traces_mutex);
+    g_traces.push_back(move(td));
+    if (g_traces.size() > MAX_TRACES)
+        g_traces.pop_front();
+}
+
+Trace::Span::Span(const char *name)
+    : index_(-1)
+{
+    if (t_trace)
+        index_ = add_event(name, TimeCounter::NowMicroS(), 0);
+}
+
+Trace::Span::~Span()
+{
+    if (index_ < 0)
+        return;
+    TraceEvent& ev = t_trace->events[index_];
+    ev.dur_us = TimeCounter::NowMicroS() - ev.start_us;
+}
+
+Trace::Span& Trace::Span::Attr(const char *key, long value)
+{
+    if (index_ >= 0)
+        add_attr(index_, key, ATTR_LONG).l = value;
+    return *this;
+}
+
+Trace::Span& Trace::Span::Attr(const char *key, double value)
+{
+    if (index_ >= 0)
+        add_attr(index_, key, ATTR_DOUBLE).d = value;
+    return *this;
+}
+
+Trace::Span& Trace::Span::Attr(const char *key, const std::string& value)
+{
+    if (index_ >= 0)
+        add_attr(index_, key, ATTR_STRING).s = value;
+    return *this;
+}
+
+bool Trace::Active()
+{
+    return t_trace != nullptr;
+}
+
+void Trace::Record(const char *name, long start_us, long end_us)
+{
+    if (t_trace)
+        add_event(name, start_us, end_us - start_us);
+}
+
+void Trace::SetSampleRate(int one_in)
+{
+    g_sample_one_in = one_in;
+}
+
+void Trace::Dump(std::string& out)
+{
+    JsonWriter writer(out);
+    lock_guard<mutex> lock(g_traces_mutex);
+    writer.BeginObject().Key("traceEvents").BeginArray();
+    for(const auto& td : g_traces) {
+        for(const auto& ev : td->events)
+            write_event(writer, *td, ev);
+    }
+    writer.EndArray().Key("displayTimeUnit").String("ms").EndObject();
+}
+
+
+}
+
@@ -0,0 +1,60 @@
+#ifndef _TRACE_HPP_
+#define _TRACE_HPP_
+#include <stdint.h>
+#include <string>
+
+namespace VideoMatch
+{
+
+
+/* Request tracing, dumped as Chrome trace JSON (chrome://tracing, Perfetto).
+
+   The thread processing a request holds a Trace::Request, Spans opened on
+   that thread are recorded into it, with attributes. Without a traced request
+   on the thread, a Span costs a thread local check only, so spans may stay
+   in hot paths. Finished traces are kept in a ring of the latest ones.
+   Times are of TimeCounter::NowMicroS(). */
+class Trace
+{
+public:
+    class Request
+    {
+        bool active_;
+    public:
+        /* trace this request if 'enabled', or if picked by sampling,
+           'start_us' is when it arrived, 0 for now */
+        Request(const char *name, bool enabled, long start_us = 0);
+        ~Request();
+    };
+
+    class Span
+    {
+        /* event in the thread's trace, -1 if not traced */
+        int index_;
+    public:
+        /* 'name' must be a literal or live as long as the server */
+        Span(const char *name);
+        ~Span();
+
+        Span& Attr(const char *key, long value);
+        Span& Attr(const char *key, double value);
+        Span& Attr(const char *key, const std::string& value);
+    };
+
+    /* if this thread is tracing a request */
+    static bool Active();
+    /* record a span already finished, e.g. timed before tracing started */
+    static void Record(const char *name, long start_us, long end_us);
+
+    /* trace one of every 'one_in' requests, 0 for none */
+    static void SetSampleRate(int one_in);
+    /* append the kept traces as Chrome trace JSON */
+    static void Dump(std::string& out);
+};
+
+
+}
+
+
+#endif
+
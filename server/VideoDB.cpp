@@ -1,5 +1,9 @@
 #include <VideoDB.hpp>
+#include <JsonWriter.hpp>
 #include <TimeCounter.hpp>
+#include <Metrics.hpp>
+#include <StatMutex.hpp>
+#include <Trace.hpp>
 #include <Log.hpp>
 #include <algorithm>
 #include <unordered_set>
@@ -47,13 +51,55 @@ static inline int bit1count(uint64_t i)
 }
 
 
+/* heap bytes of an unordered container: buckets, and nodes of a next pointer,
+   the value and 'extra' (e.g. the cached hash of a string key) */
+template<class T>
+size_t hash_bytes(const T& c, size_t extra = 0)
+{
+    return c.bucket_count() * sizeof(void *)
+        + c.size() * (sizeof(void *) + sizeof(typename T::value_type) + extra);
+}
+
+/* heap bytes of a string, short ones live in the object (libstdc++) */
+size_t string_bytes(const std::string& s)
+{
+    return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+/* scratch memory of queries in progress */
+std::atomic<long> g_scratch_bytes(0);
+std::atomic<long> g_scratch_peak(0);
+
+/* accounts scratch memory of a scope */
+class ScratchBytes
+{
+    long bytes_;
+public:
+    ScratchBytes(size_t bytes) : bytes_(bytes)
+    {
+        long cur = g_scratch_bytes += bytes_;
+        long peak = g_scratch_peak.load(std::memory_order_relaxed);
+        while(cur > peak && !g_scratch_peak.compare_exchange_weak(peak, cur))
+            ;
+    }
+    ~ScratchBytes() { g_scratch_bytes -= bytes_; }
+};
+
+/* slowest candidate goes first, as a heap comparator the fastest kept one is on top */
+bool slower(const VideoMatch::VideoDB::CandidateCost& c1, const VideoMatch::VideoDB::CandidateCost& c2)
+{
+    return c1.check_us > c2.check_us;
+}
+
+
 } // end of namespace 
 
 namespace VideoMatch
 {
 
 VideoDB::VideoDB(const string& db_path)
-    : db_path_(db_path)
+    : db_path_(db_path), postings_(0), postings_sq_(0), slot_len_log2_(64, 0),
+    items_bytes_(0), names_bytes_(0), frames_bytes_(0), frames_used_bytes_(0), postings_bytes_(0), probes_(0), probed_frames_(0), probe_queries_(0)
 {
     (void) pthread_once(&bit1_table_inited, make_bit1_table);
 }
@@ -64,17 +110,33 @@ VideoDB::~VideoDB()
     //Force exit, no need to clean anything
 }
 
-int VideoDB::get_candidates1(const vector<uint64_t>& frames, vector<DataItem*>& result) const
+int VideoDB::get_candidates1(const vector<uint64_t>& frames, vector<DataItem*>& result,
+        long deadline_us, QueryStat& stat) const
 {
+    /* check deadline once per so many frames looked up */
+    static const size_t DEADLINE_CHECK_FRAMES = 256;
     unordered_set<uint64_t> unique_frames;
     unordered_set<DataItem*> result_set;
+    size_t looked_up = 0;
+    /* index entries of the same frame hash, and candidates cut by length */
+    long seeds = 0, length_filtered = 0;
+    Trace::Span span("get_candidates1");
 
     /* query frames may contain some duplicates */
     for(const auto k : frames) 
         unique_frames.insert(k);
 
-    lock_guard<mutex> lock(mutex_);
+    StatMutex::Lock lock(mutex_, StatMutex::QUERY_CANDIDATES);
+    stat.lock_wait_us = lock.WaitMicroS();
     for(const auto k : unique_frames) {
+        if (deadline_us && looked_up % DEADLINE_CHECK_FRAMES == 0
+                && TimeCounter::NowMicroS() > deadline_us) {
+            stat.partial = true;
+            stat.skipped_frames = unique_frames.size() - looked_up;
+            break;
+        }
+        looked_up++;
+
         /* skip empty frame, since too much videos may contain it */
         if (k == EMPTY_FRAME)
             continue;
@@ -88,21 +150,40 @@ int VideoDB::get_candidates1(const vector<uint64_t>& frames, vector<DataItem*>&
         if (kb == nullptr)
             continue;
 
+        stat.probes += kb->size();
         for(auto &i : *kb) {
-            if (i.first == k) 
+            if (i.first == k) {
                 result_set.insert(i.second);
+                seeds++;
+            }
         }
     }
+    probes_ += stat.probes;
+    probed_frames_ += looked_up;
+    probe_queries_++;
+    ScratchBytes scratch(hash_bytes(unique_frames) + hash_bytes(result_set));
 
     for(auto i : result_set) {
         /* skip video whose length differs too much, for long enough video */
-        if (i->uniq_frm_cnt > 60 && (
-                i->uniq_frm_cnt > unique_frames.size() * 1.5
-                || i->uniq_frm_cnt * 1.5 < unique_frames.size()))
+        if (tuning_.length_ratio > 0 && i->uniq_frm_cnt > tuning_.length_min_frames && (
+                i->uniq_frm_cnt > unique_frames.size() * tuning_.length_ratio
+                || i->uniq_frm_cnt * tuning_.length_ratio < unique_frames.size())) {
+            length_filtered++;
             continue;
+        }
         i->inc_ref();
         result.push_back(i);
     }
+    stat.frames = frames.size();
+    stat.uniq_frames = unique_frames.size();
+    stat.candidates = result.size();
+    span.Attr("frames", (long)stat.frames)
+        .Attr("uniq_frames", (long)stat.uniq_frames)
+        .Attr("looked_up", (long)looked_up)
+        .Attr("probes", (long)stat.probes)
+        .Attr("seeds", seeds)
+        .Attr("length_filtered", length_filtered)
+        .Attr("candidates", (long)stat.candidates);
     return (int)result.size();
 }
 
@@ -143,14 +224,15 @@ static int min_diff_bits(uint64_t key, const vector<uint64_t>& base, int start,
 
 /* not interchangeable, the result depends on the arguments' order,
    but it does not matters much */
-double VideoDB::check_candidate(DataItem *data_item1, const DataItem& data_item2) const
+double VideoDB::check_candidate(DataItem *data_item1, const DataItem& data_item2, long deadline_us) const
 {
-    /* if no CMF found, decide how many frames to skip to check MDF, 
-       since finding MDF is O(n), it's not good to check every frame for MDF */
-    static const int SKIP_SPLIT_PARTS = 32;
-    static const int CHECK_BITS = 12;
+    /* if no CMF found, decide how many frames to skip to check MDF 
+       (tuning_.skip_split_parts), since finding MDF is O(n),
+       it's not good to check every frame for MDF */
     static const int STOP_CHECK_BITS = 28;
     static const int GOOD_BITS = 4;
+    /* check deadline once per so many frames, MDF check of one frame is O(n) */
+    static const size_t DEADLINE_CHECK_FRAMES = 16;
 
     unordered_multimap<uint64_t, int> base_frames;
     const auto& cf = data_item2.frames_;
@@ -168,9 +250,10 @@ double VideoDB::check_candidate(DataItem *data_item1, const DataItem& data_item2
     
     for(size_t i = 0; i < bf.size(); i++) 
         base_frames.insert(make_pair(bf[i], (int)i));
+    ScratchBytes scratch(hash_bytes(base_frames) + bmark.size() + cmark.size());
 
 
-    int skip_itvl = cf.size() / SKIP_SPLIT_PARTS; // 0 also works
+    int skip_itvl = cf.size() / tuning_.skip_split_parts; // 0 also works
     auto check_range = [&](int cpos, int bpos) {
         /* when found a CMF or MDF, 
            check ahead and backward to see how much frames matched around here */
@@ -199,6 +282,12 @@ double VideoDB::check_candidate(DataItem *data_item1, const DataItem& data_item2
     int skipped = 0;
     /* check all frames, with different strategies */
     for(size_t i = 0; i < cf.size(); i++) {
+        if (deadline_us && i % DEADLINE_CHECK_FRAMES == 0
+                && TimeCounter::NowMicroS() > deadline_us) {
+            LOG_DEBUG("Deadline passed while comparing with %s", data_item1->name_.c_str());
+            return -1.0;
+        }
+
         /* matched frame already found for this one(good enough match), 
          skip it for speed */
         if (cmark[i] < GOOD_BITS)
@@ -234,7 +323,7 @@ double VideoDB::check_candidate(DataItem *data_item1, const DataItem& data_item2
         int diff =  min_diff_bits(cf[i], bf, 0, bf.size(), mdf_pos);
 
         /* no possible similar frame found */
-        if (diff > CHECK_BITS)
+        if (diff > tuning_.check_bits)
             continue;
 
         if (diff < bmark[mdf_pos])
@@ -298,8 +387,9 @@ int VideoDB::Load()
     off_t fsize;
     int db_size, kb_num;
     //bool new_ver_file = false;
+    Metrics::Timer t(Metrics::H_LOAD);
 
-    lock_guard<mutex> lock(mutex_);
+    StatMutex::Lock lock(mutex_, StatMutex::LOAD);
 
     for(;;) { // avoid goto
     snprintf(fn, 255, "%s/videomatch_db.bin", db_path_.c_str());
@@ -342,6 +432,7 @@ int VideoDB::Load()
         if (hslot_cnt[i]) {
             KeyBlock *kb = new KeyBlock;
             kb->reserve(hslot_cnt[i]);
+            postings_bytes_ += kb->capacity() * sizeof(KeyBlock::value_type);
             table_.insert(make_pair(i, kb));
         }
     }
@@ -425,6 +516,7 @@ int VideoDB::Load()
 int VideoDB::Save()
 {
     static const int BS = 8192;
+    Metrics::Timer t(Metrics::H_SAVE);
     char block[BS];
     char *s = block;
     char fn[255], fn2[255];
@@ -450,7 +542,7 @@ int VideoDB::Save()
         }
     };
 
-    lock_guard<mutex> lock(mutex_);
+    StatMutex::Lock lock(mutex_, StatMutex::SAVE);
 
     strcpy(s, FILE_SIG); s += strlen(FILE_SIG);   
     *(int *)s = (int)(db_.size()); s += sizeof(int);
@@ -515,7 +607,12 @@ void VideoDB::add_frames_to_index(DataItem *di)
         unique_frames.insert(k);
     }
 
+    /* called once per item, by Add() and Load() */
     di->uniq_frm_cnt = unique_frames.size();
+    items_bytes_ += sizeof(DataItem);
+    names_bytes_ += 2 * string_bytes(di->name_);
+    frames_bytes_ += di->frames_.capacity() * sizeof(uint64_t);
+    frames_used_bytes_ += di->frames_.size() * sizeof(uint64_t);
     for(const auto& k : unique_frames) {
         KeyBlock *kb;
         uint32_t k2 = key_shorten(k);
@@ -526,13 +623,43 @@ void VideoDB::add_frames_to_index(DataItem *di)
         } else
             kb = it->second;
         
+        size_t old_capacity = kb->capacity();
         kb->push_back(make_pair(k, di));
+        count_posting(k2, kb, old_capacity);
+    }
+}
+
+void VideoDB::count_posting(uint32_t slot, const KeyBlock *kb, size_t old_capacity)
+{
+    size_t len = kb->size();
+    postings_++;
+    /* (n + 1)^2 - n^2 */
+    postings_sq_ += 2 * len - 1;
+    postings_bytes_ += (kb->capacity() - old_capacity) * sizeof(KeyBlock::value_type);
+    if (len > 1)
+        slot_len_log2_[63 - __builtin_clzll(len - 1)]--;
+    slot_len_log2_[63 - __builtin_clzll(len)]++;
+
+    /* a slot out of the hot ones is not longer than any of them,
+       it gets in by growing longer than the shortest */
+    size_t min_pos = 0;
+    for(size_t i = 0; i < hot_slots_.size(); i++) {
+        if (hot_slots_[i].first == slot) {
+            hot_slots_[i].second = len;
+            return;
+        }
+        if (hot_slots_[i].second < hot_slots_[min_pos].second)
+            min_pos = i;
     }
+    if (hot_slots_.size() < HOT_SLOTS_NUM)
+        hot_slots_.push_back(make_pair(slot, len));
+    else if (len > hot_slots_[min_pos].second)
+        hot_slots_[min_pos] = make_pair(slot, len);
 }
 
 int VideoDB::Add(const DataItem& data_item)
 {
-    lock_guard<mutex> lock(mutex_);
+    StatMutex::Lock lock(mutex_, StatMutex::ADD);
 
     auto it = db_.find(data_item.name_);
     /* duplicate key name not allowed, nor overwrite when happened */
@@ -552,7 +679,7 @@ int VideoDB::Add(const DataItem& data_item)
 
 int VideoDB::Query(const string& video_name, DataItem& data_item) const
 {
-    lock_guard<mutex> lock(mutex_);
+    StatMutex::Lock lock(mutex_, StatMutex::QUERY_NAME);
     LOG_DEBUG("looking for video %s", video_name.c_str());
     auto it = db_.find(video_name);
     if (it == db_.end()) {
@@ -566,34 +693,108 @@ int VideoDB::Query(const string& video_name, DataItem& data_item) const
 
 int VideoDB::Query(const DataItem& data_item, vector<pair<string, double>>& result) const
 {
-    /* 0.3 * 0.3 */
-    static const double threshold = 0.09;
+    return Query(data_item, QueryParam(), result);
+}
+
+int VideoDB::Query(const DataItem& data_item, const QueryParam& param,
+        vector<pair<string, double>>& result, QueryStat *stat) const
+{
     vector<DataItem *> candidates;
+    QueryStat local_stat;
     TimeCounter tc;
+    Trace::Span span("VideoDB::Query");
+
+    if (stat == nullptr)
+        stat = &local_stat;
+
+    /* better score goes first, as a heap comparator the worst kept result is on top */
+    auto better = [](const pair<string, double>& p1, const pair<string, double>& p2) {
+        return p1.second > p2.second;
+    };
 
     /* query operation has two steps:  find out all candidates that contains any frame in this video 
        then check each candidate by check_candidate() */
-    int cand_num = get_candidates1(data_item.frames_, candidates);
+    result.clear();
+    long cand_start = TimeCounter::NowMicroS();
+    int cand_num = get_candidates1(data_item.frames_, candidates, param.deadline_us, *stat);
+    stat->candidates_us = TimeCounter::NowMicroS() - cand_start;
+    Metrics::Observe(Metrics::H_GET_CANDIDATES, stat->candidates_us);
     LOG_DEBUG("level1 candidate num: %d", cand_num);
+    if (param.limit)
+        result.reserve(min(param.limit, candidates.size()));
     for(auto i : candidates) {
-        double score = check_candidate(i, data_item);
+        /* deadline passed, only release the rest */
+        if (stat->unscored) {
+            stat->unscored++;
+            i->dec_ref();
+            continue;
+        }
+        Trace::Span check_span("check_candidate");
+        long check_start = TimeCounter::NowMicroS();
+        double score = check_candidate(i, data_item, param.deadline_us);
+        long check_us = TimeCounter::NowMicroS() - check_start;
+        Metrics::Observe(Metrics::H_CHECK_CANDIDATE, check_us);
+        stat->check_us += check_us;
+        /* bounded heap of the most expensive candidates */
+        auto& slowest = stat->slowest;
+        if (slowest.size() < QueryStat::SLOWEST_NUM || check_us > slowest.front().check_us) {
+            if (slowest.size() == QueryStat::SLOWEST_NUM) {
+                pop_heap(slowest.begin(), slowest.end(), slower);
+                slowest.pop_back();
+            }
+            slowest.push_back(CandidateCost{i->name_, i->frames_.size(), check_us, score});
+            push_heap(slowest.begin(), slowest.end(), slower);
+        }
+        check_span.Attr("candidate", i->name_)
+            .Attr("frames", (long)i->frames_.size())
+            .Attr("score", score);
+        if (score < 0) {
+            stat->partial = true;
+            stat->unscored++;
+            i->dec_ref();
+            continue;
+        }
         LOG_DEBUG("Checked candidate %s, score %f", i->name_.c_str(), score);
-        if (score > threshold)
-            result.push_back(make_pair(i->name_, score));
+        if (score > param.min_score) {
+            if (param.limit == 0) {
+                result.push_back(make_pair(i->name_, score));
+            } else if (result.size() < param.limit) {
+                result.push_back(make_pair(i->name_, score));
+                push_heap(result.begin(), result.end(), better);
+            } else if (score > result.front().second) {
+                /* bounded heap, replace the worst one */
+                pop_heap(result.begin(), result.end(), better);
+                result.back() = make_pair(i->name_, score);
+                push_heap(result.begin(), result.end(), better);
+            }
+        }
         i->dec_ref();
     }
-    sort(result.begin(), result.end(), 
-            [](const pair<string, double>& p1, const pair<string, double>& p2) {
-                return p1.second > p2.second;
-            });
+    {
+        Metrics::Timer t(Metrics::H_RESULT_SORT);
+        Trace::Span sort_span("result_sort");
+        if (param.limit)
+            sort_heap(result.begin(), result.end(), better);
+        else
+            sort(result.begin(), result.end(), better);
+        sort_heap(stat->slowest.begin(), stat->slowest.end(), slower);
+    }
     LOG_DEBUG("Query time: %ld ms(%d cand, %d result)", tc.GetTimeMilliS(), cand_num, (int)result.size());
+    span.Attr("frames", (long)data_item.frames_.size())
+        .Attr("limit", (long)param.limit)
+        .Attr("candidates", (long)cand_num)
+        .Attr("results", (long)result.size())
+        .Attr("unscored", (long)stat->unscored);
+    if (stat->partial)
+        LOG_INFO("Query deadline passed, %d frames not looked up, %d of %d candidates not scored",
+                (int)stat->skipped_frames, (int)stat->unscored, cand_num);
     return (int)result.size();
 }
 
 /* Not impelemented */
 int VideoDB::Remove(const string& video_name)
 {
-    lock_guard<mutex> lock(mutex_);
+    StatMutex::Lock lock(mutex_, StatMutex::REMOVE);
     /*
     auto it = db_.find(video_name);
     if (it == db_.end())
@@ -607,6 +808,15 @@ int VideoDB::Remove(const string& video_name)
     return 0;
 }
 
+int VideoDB::SetTuning(const Tuning& tuning)
+{
+    if (tuning.skip_split_parts <= 0 || tuning.check_bits < 0 || tuning.check_bits > 64
+            || tuning.length_ratio < 0)
+        return -1;
+    tuning_ = tuning;
+    return 0;
+}
+
 int VideoDB::Count() const
 {
     return db_.size();
@@ -615,11 +825,8 @@ int VideoDB::Count() const
 /* duplicate frames in one video do not count */
 int VideoDB::FramesCount() const
 {
-    lock_guard<mutex> lock(mutex_);
-    int result = 0;
-    for(const auto& i : table_) 
-        result += i.second->size();
-    return result;
+    StatMutex::Lock lock(mutex_, StatMutex::FRAMES_COUNT);
+    return (int)postings_;
 }
 
 int VideoDB::FrameTableSize() const
@@ -627,6 +834,140 @@ int VideoDB::FrameTableSize() const
     return table_.size();
 }
 
+/* Everything but hot hashes is from counters, hot hashes are counted
+   in the hot slots only, where the most common hashes should be. */
+void VideoDB::IndexStats(JsonWriter& writer) const
+{
+    static const size_t HOT_HASHES_NUM = 16;
+    StatMutex::Lock lock(mutex_, StatMutex::STATS);
+
+    size_t slots_num = (size_t)1 << HSIZE_BITS;
+    auto hot_slots = hot_slots_;
+    sort(hot_slots.begin(), hot_slots.end(),
+            [](const pair<uint32_t, size_t>& s1, const pair<uint32_t, size_t>& s2) {
+                return s1.second > s2.second;
+            });
+
+    unordered_map<uint64_t, size_t> hash_count;
+    for(const auto& hs : hot_slots) {
+        auto it = table_.find(hs.first);
+        if (it == table_.end())
+            continue;
+        for(const auto& p : *it->second)
+            hash_count[p.first]++;
+    }
+    vector<pair<uint64_t, size_t>> hot_hashes(hash_count.begin(), hash_count.end());
+    size_t hot_num = min(hot_hashes.size(), HOT_HASHES_NUM);
+    partial_sort(hot_hashes.begin(), hot_hashes.begin() + hot_num, hot_hashes.end(),
+            [](const pair<uint64_t, size_t>& h1, const pair<uint64_t, size_t>& h2) {
+                return h1.second > h2.second;
+            });
+    hot_hashes.resize(hot_num);
+
+    size_t table_bytes = hash_bytes(table_) + table_.size() * sizeof(KeyBlock);
+
+    writer.BeginObject()
+        .Key("videos").UInt(db_.size())
+        .Key("postings").UInt(postings_)
+        .Key("slots").UInt(slots_num)
+        .Key("slots_used").UInt(table_.size())
+        .Key("slot_occupancy").Double((double)table_.size() / slots_num)
+        .Key("table_buckets").UInt(table_.bucket_count())
+        .Key("table_load_factor").Double(table_.load_factor())
+        .Key("mean_posting_length").Double(table_.size() ? (double)postings_ / table_.size() : 0)
+        .Key("max_posting_length").UInt(hot_slots.empty() ? 0 : hot_slots[0].second);
+
+    /* a lookup scans the whole slot, slots are hit in proportion to their length */
+    writer.Key("expected_probes_per_frame").Double(postings_ ? (double)postings_sq_ / postings_ : 0)
+        .Key("probes_per_frame").Double(probed_frames_ ? (double)probes_ / probed_frames_ : 0)
+        .Key("probes_per_query").Double(probe_queries_ ? (double)probes_ / probe_queries_ : 0)
+        .Key("queries").UInt(probe_queries_);
+
+    writer.Key("posting_length_log2").BeginArray();
+    for(size_t i = 0; i < slot_len_log2_.size(); i++) {
+        if (slot_len_log2_[i] == 0)
+            continue;
+        writer.BeginObject()
+            .Key("min").UInt((uint64_t)1 << i)
+            .Key("max").UInt(((uint64_t)2 << i) - 1)
+            .Key("slots").UInt(slot_len_log2_[i])
+            .EndObject();
+    }
+    writer.EndArray();
+
+    writer.Key("hot_slots").BeginArray();
+    for(const auto& hs : hot_slots) {
+        writer.BeginObject()
+            .Key("slot").UInt(hs.first)
+            .Key("length").UInt(hs.second)
+            .Key("share").Double(postings_ ? (double)hs.second / postings_ : 0)
+            .EndObject();
+    }
+    writer.EndArray();
+
+    writer.Key("hot_hashes").BeginArray();
+    for(const auto& hh : hot_hashes) {
+        char hex[20];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hh.first);
+        writer.BeginObject()
+            .Key("hash").String(hex)
+            .Key("videos").UInt(hh.second)
+            .EndObject();
+    }
+    writer.EndArray();
+
+    writer.Key("bytes").BeginObject()
+        .Key("frames").UInt(frames_bytes_)
+        .Key("postings").UInt(postings_bytes_)
+        .Key("table").UInt(table_bytes)
+        .EndObject();
+    writer.EndObject();
+}
+
+/* Counted as the structures grow, except hash tables, whose size is known.
+   Allocator overhead is not included. */
+void VideoDB::MemoryStats(JsonWriter& writer) const
+{
+    StatMutex::Lock lock(mutex_, StatMutex::STATS);
+
+    size_t db_bytes = hash_bytes(db_, sizeof(size_t));
+    size_t table_bytes = hash_bytes(table_);
+    size_t keyblocks_bytes = table_.size() * sizeof(KeyBlock);
+    size_t postings_used = postings_ * sizeof(KeyBlock::value_type);
+    long scratch = g_scratch_bytes;
+    size_t total = db_bytes + names_bytes_ + items_bytes_ + frames_bytes_
+        + table_bytes + keyblocks_bytes + postings_bytes_ + scratch;
+
+    writer.BeginObject()
+        .Key("videos").UInt(db_.size())
+        .Key("db").BeginObject()
+            .Key("table").UInt(db_bytes)
+            .Key("names").UInt(names_bytes_)
+            .Key("items").UInt(items_bytes_)
+            .EndObject()
+        .Key("frames").BeginObject()
+            .Key("used").UInt(frames_used_bytes_)
+            .Key("capacity").UInt(frames_bytes_)
+            .EndObject()
+        .Key("index").BeginObject()
+            .Key("table").UInt(table_bytes)
+            .Key("keyblocks").UInt(keyblocks_bytes)
+            .Key("postings_used").UInt(postings_used)
+            .Key("postings_capacity").UInt(postings_bytes_)
+            .EndObject()
+        .Key("scratch").BeginObject()
+            .Key("current").Int(scratch)
+            .Key("peak").Int(g_scratch_peak)
+            .EndObject()
+        .Key("total").UInt(total);
+
+    /* for planning capacity, assuming coming videos are like the ones in DB */
+    writer.Key("bytes_per_video").Double(db_.empty() ? 0 : (double)total / db_.size())
+        .Key("bytes_per_frame").Double(postings_ ? (double)total / postings_ : 0)
+        .Key("frames_per_video").Double(db_.empty() ? 0 : (double)postings_ / db_.size());
+    writer.EndObject();
+}
+
 }
 
 
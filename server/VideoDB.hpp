@@ -8,21 +8,26 @@
 #include <utility>
 #include <string>
 #include <unordered_map>
-#include <mutex>
+#include <StatMutex.hpp>
 
 namespace VideoMatch
 {
 
+class JsonWriter;
+
 
 
 
 class VideoDB 
 {
+    /* bench.cpp, for the private hot paths */
+    friend class VideoDBBench;
 
 public:
     class DataItem
     {
         friend class VideoDB;
+        friend class VideoDBBench;
         /* do not need init, 
          will be set in VideoDB::add_frame_to_index */
         size_t uniq_frm_cnt;
@@ -60,6 +65,12 @@ public:
         {
         }
 
+        /* take over the frames buffer, e.g. filled by RequestParser */
+        DataItem(const std::string& name, std::vector<uint64_t>&& frames)
+            : name_(name), frames_(std::move(frames)), ref_(0), deleted_(false) 
+        {
+        }
+
         DataItem(const DataItem& data_item)
             : name_(data_item.name_), 
             frames_(data_item.frames_),ref_(0), deleted_(false)
@@ -84,6 +95,77 @@ public:
     };
 
 
+    /* options of a query by frames */
+    struct QueryParam
+    {
+        /* max number of results (best first), 0 means no limit */
+        size_t limit;
+        /* only candidates scoring above it are returned, 0.3 * 0.3 by default */
+        double min_score;
+        /* by TimeCounter::NowMicroS(), 0 means no deadline.
+           when passed, the query stops and returns what is scored so far */
+        long deadline_us;
+
+        QueryParam() : limit(0), min_score(0.09), deadline_us(0) {}
+    };
+
+    /* time spent on scoring one candidate */
+    struct CandidateCost
+    {
+        std::string name;
+        size_t frames;
+        long check_us;
+        double score;
+    };
+
+    /* knobs of the matcher trading accuracy for speed, for evaluation
+       sweeps (see eval.cpp), the defaults are what the server runs with */
+    struct Tuning
+    {
+        /* MDF of one of every frames / skip_split_parts query frames is
+           searched, when the frame has no CMF */
+        int skip_split_parts;
+        /* hamming radius of an MDF */
+        int check_bits;
+        /* candidates with more than length_min_frames unique frames, and
+           length_ratio times more or less than the query, are not checked,
+           0 ratio checks all */
+        double length_ratio;
+        size_t length_min_frames;
+
+        Tuning() : skip_split_parts(32), check_bits(12), length_ratio(1.5), length_min_frames(60) {}
+    };
+
+    /* what a query by frames went through */
+    struct QueryStat
+    {
+        /* most expensive candidates kept in 'slowest' */
+        static const size_t SLOWEST_NUM = 5;
+
+        size_t frames;
+        size_t uniq_frames;
+        size_t candidates;
+        /* deadline passed: frames not looked up for candidates,
+           and candidates not scored */
+        bool partial;
+        size_t skipped_frames;
+        size_t unscored;
+        /* index entries compared while looking up candidates */
+        size_t probes;
+        /* time waited for the index lock, looking up candidates,
+           and scoring all of them */
+        long lock_wait_us;
+        long candidates_us;
+        long check_us;
+        /* most expensive first */
+        std::vector<CandidateCost> slowest;
+
+        QueryStat() : frames(0), uniq_frames(0), candidates(0),
+            partial(false), skipped_frames(0), unscored(0), probes(0),
+            lock_wait_us(0), candidates_us(0), check_us(0) {}
+    };
+
+
     //////////////////////////////////////////////////////////
 private:
     static const int HSIZE_BITS = 20;
@@ -93,12 +175,37 @@ private:
 
     /* index for frames*/
     std::unordered_map<uint32_t, KeyBlock*> table_;
-    mutable std::mutex mutex_;
+    mutable StatMutex mutex_;
 
     std::string db_path_;
-
-    int get_candidates1(const std::vector<uint64_t>& frames, std::vector<DataItem*>& result) const;
-    double check_candidate(DataItem *data_item1, const DataItem& data_item2) const;
+    Tuning tuning_;
+
+    /* shape of the index, maintained by add_frames_to_index(),
+       a slot is the KeyBlock of key_shorten() of a frame */
+    static const size_t HOT_SLOTS_NUM = 16;
+    size_t postings_;
+    /* sum of squared slot lengths, for the expected probes of a lookup */
+    uint64_t postings_sq_;
+    /* slots by floor(log2(length)) */
+    std::vector<size_t> slot_len_log2_;
+    /* longest slots (exact since lengths only grow), and their lengths */
+    std::vector<std::pair<uint32_t, size_t>> hot_slots_;
+    /* bytes of DataItem objects and their names (in db_ too),
+       frames of videos (capacity and size), and KeyBlock entries (capacity) */
+    size_t items_bytes_;
+    size_t names_bytes_;
+    size_t frames_bytes_;
+    size_t frames_used_bytes_;
+    size_t postings_bytes_;
+    /* probe work done by queries */
+    mutable uint64_t probes_;
+    mutable uint64_t probed_frames_;
+    mutable uint64_t probe_queries_;
+
+    int get_candidates1(const std::vector<uint64_t>& frames, std::vector<DataItem*>& result,
+            long deadline_us, QueryStat& stat) const;
+    /* return score, or negative if deadline passed before finished */
+    double check_candidate(DataItem *data_item1, const DataItem& data_item2, long deadline_us) const;
     uint32_t key_shorten(uint64_t raw) const
     {
         /* 2 Million (21bits) slots*/
@@ -106,6 +213,8 @@ private:
     }
 
     void add_frames_to_index(DataItem *di);
+    /* count a posting just added to 'kb' of 'slot' */
+    void count_posting(uint32_t slot, const KeyBlock *kb, size_t old_capacity);
 
 public:
     VideoDB(const std::string& db_path);
@@ -117,11 +226,22 @@ public:
     int Add(const DataItem& data_item);
     int Query(const std::string& video_name, DataItem& data_item) const ;
     int Query(const DataItem& data_item, std::vector<std::pair<std::string, double>>& result) const;
+    int Query(const DataItem& data_item, const QueryParam& param,
+            std::vector<std::pair<std::string, double>>& result, QueryStat *stat = nullptr) const;
     int Remove(const std::string& video_name);
 
+    /* not synchronized with queries, set before serving them,
+       return -1 if out of range */
+    int SetTuning(const Tuning& tuning);
+    const Tuning& GetTuning() const { return tuning_; }
+
     int Count() const;
     int FramesCount() const;
     int FrameTableSize() const;
+    /* shape of the index, as a json object */
+    void IndexStats(JsonWriter& writer) const;
+    /* bytes used by each structure, as a json object */
+    void MemoryStats(JsonWriter& writer) const;
 };
 
 
@@ -0,0 +1,409 @@
+#include <RequestParser.hpp>
+#include <SyntheticCorpus.hpp>
+#include <VideoDB.hpp>
+#include <TimeCounter.hpp>
+#include <Log.hpp>
+#include <json/json.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+   Benchmarks of the match server hot paths, run by 'make bench && ./bench'.
+       ./bench [-s seed] [-n videos] [-q queries] [-r rounds] [bench ...]
+   runs the named benches (json_parse, get_candidates1, check_candidate,
+   add_frames_to_index, save_load), all by default, on a SyntheticCorpus of
+   the seed. Each result is one line:
+       <bench name> <case> <key>=<value> ...
+   timings are the median of the rounds, so the output of a change can be
+   compared line by line with the baseline's of the same arguments.
+*/
+
+using namespace std;
+using namespace VideoMatch;
+
+/* count every heap allocation of the process */
+static atomic<long> g_alloc_count(0);
+
+void *operator new(size_t size)
+{
+    g_alloc_count++;
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr)
+        throw bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+namespace {
+
+/* same format as client/Requester.cpp sends */
+string make_request(const char *type, int frame_num, mt19937_64& rng)
+{
+    Json::StyledWriter writer;
+    Json::Value v;
+
+    v["type"] = type;
+    v["name"] = "bench_video";
+    for(int i = 0; i < frame_num; i++)
+        v["frames"][i] = (Json::Value::UInt64)rng();
+    return writer.write(v);
+}
+
+/* the old path: json DOM, then copy into DataItem */
+size_t parse_dom(const string& request)
+{
+    Json::Reader reader;
+    Json::Value v;
+    if (!reader.parse(request.c_str(), v, false))
+        return 0;
+    VideoDB::DataItem data_item(v["name"].asString());
+    Json::Value& frames = v["frames"];
+    int fc = frames.size();
+    for(int i = 0; i < fc; i++)
+        data_item.Push(frames[i].asUInt64());
+    return fc;
+}
+
+size_t parse_stream(const string& request)
+{
+    ParsedRequest req;
+    if (RequestParser::Parse(request.data(), request.size(), req) < 0)
+        return 0;
+    size_t fc = req.frames.size();
+    VideoDB::DataItem data_item(req.name, std::move(req.frames));
+    return fc;
+}
+
+void bench_parse()
+{
+    static const int FRAME_NUMS[] = {100, 1000, 10000};
+    mt19937_64 rng(8964);
+
+    for(int frame_num : FRAME_NUMS) {
+        string request = make_request("add", frame_num, rng);
+        int rounds = 20000000 / (frame_num * 20) + 1;
+
+        auto run = [&](const char *name, size_t (*fn)(const string&)) {
+            volatile size_t sink = 0;
+            sink += fn(request); // warm up
+            long allocs = g_alloc_count;
+            TimeCounter tc;
+            for(int i = 0; i < rounds; i++)
+                sink += fn(request);
+            long us = tc.GetTimeMicroS();
+            allocs = g_alloc_count - allocs;
+            printf("json_parse %s frames=%d bytes=%d rounds=%d MBps=%.1f allocs_per_req=%.1f us_per_req=%.1f\n",
+                    name, frame_num, (int)request.size(), rounds,
+                    (double)request.size() * rounds / (us ? us : 1),
+                    (double)allocs / rounds, (double)us / rounds);
+        };
+        run("dom", &parse_dom);
+        run("stream", &parse_stream);
+    }
+}
+
+} //end of namespace
+
+
+namespace VideoMatch
+{
+
+/* the private hot paths of VideoDB, without deadline */
+class VideoDBBench
+{
+public:
+    static VideoDB::DataItem *Item(const string& name, vector<uint64_t> frames)
+    {
+        return new VideoDB::DataItem(name, std::move(frames));
+    }
+
+    static size_t Candidates(const VideoDB& db, const VideoDB::DataItem& item, VideoDB::QueryStat& stat)
+    {
+        vector<VideoDB::DataItem *> result;
+        db.get_candidates1(item.frames_, result, 0, stat);
+        for(auto di : result)
+            di->dec_ref();
+        return result.size();
+    }
+
+    static double Check(const VideoDB& db, VideoDB::DataItem *base, const VideoDB::DataItem& item)
+    {
+        return db.check_candidate(base, item, 0);
+    }
+
+    /* as Add() does, without copying the item */
+    static void Index(VideoDB& db, VideoDB::DataItem *di)
+    {
+        db.db_.insert(make_pair(di->name_, di));
+        db.add_frames_to_index(di);
+    }
+
+    static const vector<uint64_t>& Frames(const VideoDB::DataItem& item)
+    {
+        return item.frames_;
+    }
+};
+
+
+}
+
+
+namespace {
+
+struct BenchConfig
+{
+    uint64_t seed;
+    size_t videos;
+    size_t queries;
+    int rounds;
+};
+
+/* median time of 'rounds' runs of 'fn' */
+template<typename Fn>
+double median_us(int rounds, Fn fn)
+{
+    vector<long> times;
+    for(int i = 0; i < rounds; i++) {
+        TimeCounter tc;
+        fn();
+        times.push_back(tc.GetTimeMicroS());
+    }
+    sort(times.begin(), times.end());
+    return max(times[times.size() / 2], 1L);
+}
+
+string video_name(size_t i)
+{
+    return "video_" + to_string(i);
+}
+
+/* the corpus indexed, its videos are kept for deriving queries */
+struct BenchDB
+{
+    VideoDB db;
+    vector<VideoDB::DataItem *> items;
+    size_t frames;
+
+    BenchDB(const string& path) : db(path), frames(0) {}
+};
+
+void build_db(BenchDB& bdb, SyntheticCorpus& corpus, size_t videos)
+{
+    for(size_t i = 0; i < videos; i++) {
+        VideoDB::DataItem *di = VideoDBBench::Item(video_name(i), corpus.Video());
+        bdb.frames += VideoDBBench::Frames(*di).size();
+        VideoDBBench::Index(bdb.db, di);
+        bdb.items.push_back(di);
+    }
+}
+
+/* frames of a query by each case, from 'src' of the db */
+vector<uint64_t> make_query(const string& name, SyntheticCorpus& corpus, const vector<uint64_t>& src)
+{
+    if (name == "copy")
+        return src;
+    if (name == "noisy")
+        /* a fifth of the frames 2 bits off, more makes the query too long
+           in unique frames for the length filter */
+        return corpus.NearDuplicate(src, 2, 0.2);
+    if (name == "clip") {
+        /* a fifth of the source in a video not in the db */
+        size_t len = src.size() / 5;
+        vector<uint64_t> host = corpus.Video();
+        return SyntheticCorpus::InsertClip(host, src, corpus.Uniform(src.size() - len), len,
+                corpus.Uniform(host.size()));
+    }
+    return corpus.Video();
+}
+
+void bench_candidates(const BenchConfig& cfg, BenchDB& bdb, SyntheticCorpus& corpus)
+{
+    static const char *CASES[] = {"copy", "noisy", "clip", "miss"};
+
+    for(const char *name : CASES) {
+        vector<VideoDB::DataItem *> queries;
+        for(size_t i = 0; i < cfg.queries; i++) {
+            const auto& src = bdb.items[corpus.Uniform(bdb.items.size())];
+            queries.push_back(VideoDBBench::Item("query", make_query(name, corpus, VideoDBBench::Frames(*src))));
+        }
+
+        size_t candidates = 0, probes = 0, frames = 0;
+        double us = median_us(cfg.rounds, [&]() {
+            candidates = probes = frames = 0;
+            for(auto q : queries) {
+                VideoDB::QueryStat stat;
+                candidates += VideoDBBench::Candidates(bdb.db, *q, stat);
+                probes += stat.probes;
+                frames += stat.frames;
+            }
+        });
+        printf("get_candidates1 %s videos=%d queries=%d frames_per_query=%.0f us_per_query=%.1f "
+                "probes_per_query=%.1f candidates_per_query=%.2f\n",
+                name, (int)bdb.items.size(), (int)queries.size(), (double)frames / queries.size(),
+                us / queries.size(), (double)probes / queries.size(), (double)candidates / queries.size());
+        for(auto q : queries)
+            delete q;
+    }
+}
+
+/* cmf: the query is a copy, matched by the CMF index;
+   mdf: every frame 5 bits off, no CMF and every matched frame still
+        above GOOD_BITS, so each sampled frame scans for its MDF;
+   miss: an unrelated video, the sampled frames scan and find nothing */
+void bench_check(const BenchConfig& cfg, BenchDB& bdb, SyntheticCorpus& corpus)
+{
+    static const size_t FRAME_NUMS[] = {500, 2000, 8000};
+    static const char *CASES[] = {"cmf", "mdf", "miss"};
+
+    for(size_t frame_num : FRAME_NUMS) {
+        VideoDB::DataItem *base = VideoDBBench::Item("base", corpus.Video(frame_num));
+        for(const char *name : CASES) {
+            vector<uint64_t> frames;
+            if (strcmp(name, "cmf") == 0)
+                frames = VideoDBBench::Frames(*base);
+            else if (strcmp(name, "mdf") == 0)
+                frames = corpus.NearDuplicate(VideoDBBench::Frames(*base), 5);
+            else
+                frames = corpus.Video(frame_num);
+            VideoDB::DataItem query("query", std::move(frames));
+
+            /* about 20M frame comparisons per round */
+            int checks = max(20000000 / (int)(frame_num * frame_num / 32 + frame_num), 1);
+            double score = 0;
+            double us = median_us(cfg.rounds, [&]() {
+                for(int i = 0; i < checks; i++)
+                    score = VideoDBBench::Check(bdb.db, base, query);
+            });
+            printf("check_candidate %s frames=%d checks=%d us_per_check=%.1f score=%.3f\n",
+                    name, (int)frame_num, checks, us / checks, score);
+        }
+        delete base;
+    }
+}
+
+void bench_index(const BenchConfig& cfg)
+{
+    /* the same videos each round, into a new db */
+    vector<vector<uint64_t>> videos;
+    SyntheticCorpus corpus(cfg.seed + 1);
+    size_t frames = 0;
+    for(size_t i = 0; i < cfg.videos; i++) {
+        videos.push_back(corpus.Video());
+        frames += videos.back().size();
+    }
+
+    double us = median_us(cfg.rounds, [&]() {
+        /* VideoDB frees nothing, neither do the rounds */
+        VideoDB *db = new VideoDB("");
+        for(size_t i = 0; i < videos.size(); i++)
+            VideoDBBench::Index(*db, VideoDBBench::Item(video_name(i), videos[i]));
+    });
+    printf("add_frames_to_index fresh videos=%d frames=%d us_per_video=%.1f Mframes_per_s=%.2f\n",
+            (int)videos.size(), (int)frames, us / videos.size(), frames / us);
+}
+
+void bench_save_load(const BenchConfig& cfg, BenchDB& bdb, const string& dir)
+{
+    string fn = dir + "/videomatch_db.bin";
+    double save_us = median_us(cfg.rounds, [&]() {
+        bdb.db.Save();
+    });
+
+    struct stat st;
+    if (stat(fn.c_str(), &st) != 0) {
+        fprintf(stderr, "save_load: %s not saved\n", fn.c_str());
+        return;
+    }
+    size_t loaded = 0;
+    double load_us = median_us(cfg.rounds, [&]() {
+        VideoDB *db = new VideoDB(dir);
+        db->Load();
+        loaded = db->Count();
+    });
+    if (loaded != bdb.items.size())
+        fprintf(stderr, "save_load: %d videos loaded of %d\n", (int)loaded, (int)bdb.items.size());
+
+    printf("save_load save videos=%d frames=%d bytes=%ld us=%.0f MBps=%.1f\n",
+            (int)bdb.items.size(), (int)bdb.frames, (long)st.st_size, save_us, st.st_size / save_us);
+    printf("save_load load videos=%d frames=%d bytes=%ld us=%.0f MBps=%.1f\n",
+            (int)loaded, (int)bdb.frames, (long)st.st_size, load_us, st.st_size / load_us);
+    unlink(fn.c_str());
+}
+
+void print_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-s seed] [-n videos] [-q queries] [-r rounds] [bench ...]\n"
+            "benches: json_parse get_candidates1 check_candidate add_frames_to_index save_load\n",
+            name);
+}
+
+} //end of namespace
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg = {8964, 2000, 200, 5};
+    int c;
+    while((c = getopt(argc, argv, "s:n:q:r:h")) != -1) {
+        switch(c) {
+            case 's': cfg.seed = strtoull(optarg, NULL, 10); break;
+            case 'n': cfg.videos = max(atoi(optarg), 1); break;
+            case 'q': cfg.queries = max(atoi(optarg), 1); break;
+            case 'r': cfg.rounds = max(atoi(optarg), 1); break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    vector<string> names(argv + optind, argv + argc);
+    auto wanted = [&](const char *name) {
+        return names.empty() || find(names.begin(), names.end(), name) != names.end();
+    };
+
+    /* Add() and Save() log every video */
+    g_log_level = LERROR;
+    printf("bench_config - seed=%llu videos=%d queries=%d rounds=%d\n",
+            (unsigned long long)cfg.seed, (int)cfg.videos, (int)cfg.queries, cfg.rounds);
+
+    if (wanted("json_parse"))
+        bench_parse();
+    if (wanted("add_frames_to_index"))
+        bench_index(cfg);
+    if (!wanted("get_candidates1") && !wanted("check_candidate") && !wanted("save_load"))
+        return 0;
+
+    char dir[] = "/tmp/videomatch_bench.XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    SyntheticCorpus corpus(cfg.seed);
+    BenchDB bdb(dir);
+    build_db(bdb, corpus, cfg.videos);
+    if (wanted("get_candidates1"))
+        bench_candidates(cfg, bdb, corpus);
+    if (wanted("check_candidate"))
+        bench_check(cfg, bdb, corpus);
+    if (wanted("save_load"))
+        bench_save_load(cfg, bdb, dir);
+    rmdir(dir);
+    return 0;
+}
+
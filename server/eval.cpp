@@ -0,0 +1,352 @@
+#include <FrameDedup.hpp>
+#include <SyntheticCorpus.hpp>
+#include <VideoDB.hpp>
+#include <TimeCounter.hpp>
+#include <Log.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+/*
+   Accuracy against latency of the matcher, run by 'make eval && ./eval'.
+       ./eval [-d db_dir -g pairs] [-s seed] [-n videos] [-q queries]
+              [-T thresholds] [-k knob=v1,v2,...] [-D bits] ...
+   Queries run in process, one at a time, through VideoDB::Query(), and the
+   results are judged against ground truth:
+     - with -d and -g, the videos of the db snapshot are queried by key, for
+       the first names of the pairs file ("name1 name2" per line, as
+       duplicate.sorted of test_query.sh), the video itself is not counted
+     - otherwise on a SyntheticCorpus of the seed, the queries are noisy
+       copies and clips of its videos, each the duplicate of its source,
+       and videos not in the db, duplicates of none
+   -D collapses the synthetic videos and queries as 'client -D' does
+   (FrameDedup of the client), to compare the results with and without.
+   Each -k sweeps a VideoDB::Tuning knob (skip_split_parts, check_bits,
+   length_ratio, length_min_frames), all combinations of the values are run.
+   Each result is one line, as bench's:
+       eval threshold=<t> <knobs> tp= fp= fn= precision= recall= f1=
+       eval latency <knobs> p50_ms= ...
+*/
+
+using namespace std;
+using namespace VideoMatch;
+
+
+namespace {
+
+struct Query
+{
+    /* query by key when not empty, else by frames */
+    string key;
+    vector<uint64_t> frames;
+    /* names it duplicates */
+    set<string> truth;
+};
+
+struct Knob
+{
+    string name;
+    vector<double> values;
+};
+
+string video_name(size_t i)
+{
+    return "video_" + to_string(i);
+}
+
+int set_knob(VideoDB::Tuning& tuning, const string& name, double value)
+{
+    if (name == "skip_split_parts")
+        tuning.skip_split_parts = (int)value;
+    else if (name == "check_bits")
+        tuning.check_bits = (int)value;
+    else if (name == "length_ratio")
+        tuning.length_ratio = value;
+    else if (name == "length_min_frames")
+        tuning.length_min_frames = (size_t)value;
+    else
+        return -1;
+    return 0;
+}
+
+string knobs_text(const VideoDB::Tuning& tuning)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "skip_split_parts=%d check_bits=%d length_ratio=%.2f length_min_frames=%d",
+            tuning.skip_split_parts, tuning.check_bits, tuning.length_ratio, (int)tuning.length_min_frames);
+    return buf;
+}
+
+vector<double> parse_list(const char *arg)
+{
+    vector<double> values;
+    for(const char *p = arg; *p; ) {
+        char *end;
+        values.push_back(strtod(p, &end));
+        if (end == p)
+            return vector<double>();
+        p = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+/* frames in and kept by -D */
+long g_frames = 0, g_kept_frames = 0;
+
+void dedup(vector<uint64_t>& frames, int dedup_bits)
+{
+    g_frames += frames.size();
+    if (dedup_bits >= 0) {
+        vector<uint64_t> kept;
+        vector<uint32_t> positions;
+        FrameDedup::Collapse(frames, dedup_bits, kept, positions);
+        frames.swap(kept);
+    }
+    g_kept_frames += frames.size();
+}
+
+void build_synthetic(VideoDB& db, vector<Query>& queries, uint64_t seed, size_t videos, size_t query_num,
+        int dedup_bits)
+{
+    SyntheticCorpus corpus(seed);
+    vector<vector<uint64_t>> sources;
+    for(size_t i = 0; i < videos; i++) {
+        sources.push_back(corpus.Video());
+        vector<uint64_t> frames = sources.back();
+        dedup(frames, dedup_bits);
+        db.Add(VideoDB::DataItem(video_name(i), std::move(frames)));
+    }
+
+    /* near duplicates of growing noise, clips of growing length, and misses */
+    for(size_t i = 0; i < query_num; i++) {
+        Query q;
+        size_t src = corpus.Uniform(videos);
+        const auto& frames = sources[src];
+        switch(i % 4) {
+            case 0:
+                q.frames = corpus.NearDuplicate(frames, 1 + corpus.Uniform(6), 0.5);
+                break;
+            case 1:
+                q.frames = corpus.NearDuplicate(frames, 2 + corpus.Uniform(10), 1.0);
+                break;
+            case 2: {
+                size_t len = frames.size() * (10 + corpus.Uniform(90)) / 100;
+                vector<uint64_t> host = corpus.Video();
+                q.frames = SyntheticCorpus::InsertClip(host, frames, corpus.Uniform(frames.size() - len + 1),
+                        len, corpus.Uniform(host.size()));
+                break;
+            }
+            default:
+                q.frames = corpus.Video();
+        }
+        if (i % 4 != 3)
+            q.truth.insert(video_name(src));
+        dedup(q.frames, dedup_bits);
+        queries.push_back(std::move(q));
+    }
+}
+
+int load_pairs(const char *fn, vector<Query>& queries)
+{
+    ifstream in(fn);
+    if (!in) {
+        fprintf(stderr, "Can not open %s\n", fn);
+        return -1;
+    }
+    /* duplicates are both ways, only first names are queried */
+    map<string, set<string>> truth;
+    vector<string> order;
+    string a, b;
+    while(in >> a >> b) {
+        if (truth.find(a) == truth.end())
+            order.push_back(a);
+        truth[a].insert(b);
+        truth[b].insert(a);
+    }
+    for(const auto& name : order) {
+        Query q;
+        q.key = name;
+        q.truth = truth[name];
+        queries.push_back(std::move(q));
+    }
+    return 0;
+}
+
+long percentile(const vector<long>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[min((size_t)(p * sorted.size()), sorted.size() - 1)];
+}
+
+void evaluate(const VideoDB& db, const vector<Query>& queries, const vector<double>& thresholds)
+{
+    string knobs = knobs_text(db.GetTuning());
+    VideoDB::QueryParam param;
+    param.min_score = *min_element(thresholds.begin(), thresholds.end());
+    /* a result counts at a threshold if it scores at least that */
+    param.min_score = nextafter(param.min_score, 0.0);
+
+    vector<size_t> tp(thresholds.size(), 0), fp(thresholds.size(), 0);
+    size_t positives = 0, candidates = 0;
+    vector<long> latency;
+    for(const auto& q : queries) {
+        vector<pair<string, double>> result;
+        VideoDB::QueryStat stat;
+        TimeCounter tc;
+        if (q.key.empty()) {
+            db.Query(VideoDB::DataItem("QUERY", vector<uint64_t>(q.frames)), param, result, &stat);
+        } else {
+            VideoDB::DataItem data_item("");
+            if (db.Query(q.key, data_item) < 0) {
+                fprintf(stderr, "%s is not in the db\n", q.key.c_str());
+                continue;
+            }
+            db.Query(data_item, param, result, &stat);
+        }
+        latency.push_back(tc.GetTimeMicroS());
+        candidates += stat.candidates;
+        positives += q.truth.size();
+
+        for(const auto& r : result) {
+            if (r.first == q.key)
+                continue;
+            bool hit = q.truth.count(r.first) > 0;
+            for(size_t t = 0; t < thresholds.size(); t++) {
+                if (r.second < thresholds[t])
+                    continue;
+                if (hit)
+                    tp[t]++;
+                else
+                    fp[t]++;
+            }
+        }
+    }
+
+    for(size_t t = 0; t < thresholds.size(); t++) {
+        double precision = tp[t] + fp[t] ? (double)tp[t] / (tp[t] + fp[t]) : 1.0;
+        double recall = positives ? (double)tp[t] / positives : 1.0;
+        double f1 = precision + recall > 0 ? 2 * precision * recall / (precision + recall) : 0.0;
+        printf("eval threshold=%.3f %s tp=%d fp=%d fn=%d precision=%.4f recall=%.4f f1=%.4f\n",
+                thresholds[t], knobs.c_str(), (int)tp[t], (int)fp[t], (int)(positives - tp[t]),
+                precision, recall, f1);
+    }
+    sort(latency.begin(), latency.end());
+    printf("eval latency %s queries=%d candidates_per_query=%.2f p50_ms=%.2f p90_ms=%.2f p99_ms=%.2f max_ms=%.2f\n",
+            knobs.c_str(), (int)latency.size(), latency.empty() ? 0.0 : (double)candidates / latency.size(),
+            percentile(latency, 0.5) / 1000.0, percentile(latency, 0.9) / 1000.0,
+            percentile(latency, 0.99) / 1000.0, latency.empty() ? 0.0 : latency.back() / 1000.0);
+}
+
+/* every combination of the knobs' values, the first knob changes slowest */
+void sweep(VideoDB& db, const vector<Query>& queries, const vector<double>& thresholds,
+        const vector<Knob>& knobs, size_t k, VideoDB::Tuning tuning)
+{
+    if (k == knobs.size()) {
+        if (db.SetTuning(tuning) < 0) {
+            fprintf(stderr, "Bad tuning: %s\n", knobs_text(tuning).c_str());
+            return;
+        }
+        evaluate(db, queries, thresholds);
+        return;
+    }
+    for(double value : knobs[k].values) {
+        set_knob(tuning, knobs[k].name, value);
+        sweep(db, queries, thresholds, knobs, k + 1, tuning);
+    }
+}
+
+void print_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "\t-d <path> -g <file>                 db snapshot directory and its duplicate pairs\n"
+            "\t-s <seed> [default 8964]            synthetic corpus without -d\n"
+            "\t-n <videos> [default 2000]          synthetic videos in the db\n"
+            "\t-q <queries> [default 400]          synthetic queries\n"
+            "\t-T <t1,t2,...>                      score thresholds, default 0.05 to 0.8\n"
+            "\t-k <knob>=<v1,v2,...>               sweep a knob in [skip_split_parts|check_bits|\n"
+            "\t                                    length_ratio|length_min_frames]\n"
+            "\t-D <bits>                           collapse runs of frames within bits, synthetic only\n",
+            name);
+}
+
+} //end of namespace
+
+int main(int argc, char *argv[])
+{
+    const char *dir = nullptr;
+    const char *pairs = nullptr;
+    uint64_t seed = 8964;
+    size_t videos = 2000, query_num = 400;
+    vector<double> thresholds = {0.05, 0.09, 0.15, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8};
+    vector<Knob> knobs;
+    int dedup_bits = -1;
+
+    int c;
+    while((c = getopt(argc, argv, "d:g:s:n:q:T:k:D:h")) != -1) {
+        switch(c) {
+            case 'd': dir = optarg; break;
+            case 'g': pairs = optarg; break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'n': videos = max(atoi(optarg), 1); break;
+            case 'q': query_num = max(atoi(optarg), 1); break;
+            case 'D': dedup_bits = atoi(optarg); break;
+            case 'T':
+                thresholds = parse_list(optarg);
+                if (thresholds.empty()) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'k': {
+                const char *eq = strchr(optarg, '=');
+                VideoDB::Tuning tuning;
+                Knob knob;
+                if (eq) {
+                    knob.name.assign(optarg, eq - optarg);
+                    knob.values = parse_list(eq + 1);
+                }
+                if (eq == nullptr || knob.values.empty() || set_knob(tuning, knob.name, 0) < 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                knobs.push_back(knob);
+                break;
+            }
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if ((dir == nullptr) != (pairs == nullptr) || (dir && dedup_bits >= 0)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* Add() logs every video */
+    g_log_level = LERROR;
+
+    VideoDB db(dir ? dir : "");
+    vector<Query> queries;
+    if (dir) {
+        if (db.Load() < 0 || load_pairs(pairs, queries) < 0)
+            return 1;
+    } else {
+        build_synthetic(db, queries, seed, videos, query_num, dedup_bits);
+    }
+    printf("eval_config - source=%s seed=%llu videos=%d queries=%d dedup_bits=%d frames=%ld kept_frames=%ld\n",
+            dir ? dir : "synthetic", (unsigned long long)seed, db.Count(), (int)queries.size(),
+            dedup_bits, g_frames, g_kept_frames);
+
+    sweep(db, queries, thresholds, knobs, 0, VideoDB::Tuning());
+    return 0;
+}
+
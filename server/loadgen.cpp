@@ -0,0 +1,622 @@
+#include <SyntheticCorpus.hpp>
+#include <TimeCounter.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+   Load generator of the match server, run by 'make loadgen && ./loadgen'.
+
+   Each of -c connections is a thread with a keep-alive socket. Closed loop
+   (default) sends the next request when the reply of the last one is read;
+   open loop (-R rate) sends request k at start + k / rate, whatever the
+   replies, and measures its latency from that time, so the server falling
+   behind shows in the percentiles instead of slowing the load down.
+
+   Requests are a mix (-m) of add, query_duplicate and querykey from a
+   SyntheticCorpus of the seed: -p videos are added before the run, queries
+   are copies, noisy copies or clips of them, and querykeys ask for their
+   names. Or they are read from a request log (-l), one per line:
+       GET <path>
+       POST <path> <json body in one line>
+   and sent in turn. -w writes the synthetic requests in that format.
+
+   Each result is one line, as bench's:
+       loadgen <type> <key>=<value> ...
+*/
+
+using namespace std;
+using namespace VideoMatch;
+
+
+namespace {
+
+enum ReqType {
+    ADD,
+    QUERY,
+    QUERYKEY,
+    OTHER,
+    TYPE_NUM,
+};
+
+static const char *TYPE_NAMES[TYPE_NUM] = {"add", "query_duplicate", "querykey", "other"};
+
+struct Request
+{
+    ReqType type;
+    bool post;
+    string path;
+    string body;
+};
+
+struct Config
+{
+    string host;
+    string port;
+    int connections;
+    int duration_s;
+    double rate;
+    uint64_t seed;
+    size_t preload;
+    int mix[TYPE_NUM];
+    string log_file;
+    string write_file;
+};
+
+/* latencies and failures of one thread, merged at the end */
+struct Stat
+{
+    vector<long> latency_us[TYPE_NUM];
+    /* replies other than 200, of them 503 of admission */
+    size_t errors[TYPE_NUM];
+    size_t busy[TYPE_NUM];
+    /* connection lost, the request is counted in errors too */
+    size_t io_errors;
+
+    Stat() : io_errors(0)
+    {
+        fill(errors, errors + TYPE_NUM, 0);
+        fill(busy, busy + TYPE_NUM, 0);
+    }
+};
+
+ReqType type_of(bool post, const string& path, const string& body)
+{
+    if (!post)
+        return path.compare(0, 10, "/querykey/") == 0
+            || path.compare(0, 15, "/querykeyplain/") == 0 ? QUERYKEY : OTHER;
+    if (body.find("\"add\"") != string::npos)
+        return ADD;
+    if (body.find("\"query_duplicate\"") != string::npos)
+        return QUERY;
+    return OTHER;
+}
+
+/* one keep-alive HTTP/1.1 connection, reconnected when lost */
+class Connection
+{
+public:
+    Connection(const Config& cfg) : cfg_(cfg), fd_(-1) {}
+    ~Connection() { disconnect(); }
+
+    /* return the status code, or -1 if the connection failed */
+    int Send(const Request& req)
+    {
+        if (fd_ < 0 && connect_server() < 0)
+            return -1;
+
+        string msg = (req.post ? "POST " : "GET ") + req.path + " HTTP/1.1\r\n"
+            "Host: " + cfg_.host + "\r\n";
+        if (req.post)
+            msg += "Content-Type: application/json\r\n"
+                "Content-Length: " + to_string(req.body.size()) + "\r\n";
+        msg += "\r\n";
+        msg += req.body;
+
+        int status;
+        if (write_all(msg) < 0 || read_reply(status) < 0) {
+            disconnect();
+            return -1;
+        }
+        return status;
+    }
+
+private:
+    const Config& cfg_;
+    int fd_;
+    string buf_;
+
+    int connect_server()
+    {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(cfg_.host.c_str(), cfg_.port.c_str(), &hints, &res) != 0)
+            return -1;
+        for(struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+            fd_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd_ < 0)
+                continue;
+            if (connect(fd_, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd_);
+            fd_ = -1;
+        }
+        freeaddrinfo(res);
+        if (fd_ < 0)
+            return -1;
+
+        int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct timeval tv = {60, 0};
+        setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        buf_.clear();
+        return 0;
+    }
+
+    void disconnect()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+        fd_ = -1;
+        buf_.clear();
+    }
+
+    int write_all(const string& msg)
+    {
+        size_t sent = 0;
+        while(sent < msg.size()) {
+            ssize_t n = send(fd_, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            sent += n;
+        }
+        return 0;
+    }
+
+    /* append what arrives to buf_, return 0 at end of stream */
+    ssize_t fill()
+    {
+        char tmp[65536];
+        ssize_t n;
+        do {
+            n = recv(fd_, tmp, sizeof(tmp), 0);
+        } while(n < 0 && errno == EINTR);
+        if (n > 0)
+            buf_.append(tmp, n);
+        return n;
+    }
+
+    /* wait until buf_ has 'size' bytes */
+    int need(size_t size)
+    {
+        while(buf_.size() < size)
+            if (fill() <= 0)
+                return -1;
+        return 0;
+    }
+
+    /* find "\r\n" from 'pos', reading more as needed */
+    size_t line_end(size_t pos)
+    {
+        size_t end;
+        while((end = buf_.find("\r\n", pos)) == string::npos)
+            if (fill() <= 0)
+                return string::npos;
+        return end;
+    }
+
+    /* body by Content-Length, chunks, or until closed;
+       the body is dropped, only the status matters */
+    int read_reply(int& status)
+    {
+        size_t header_end;
+        while((header_end = buf_.find("\r\n\r\n")) == string::npos)
+            if (fill() <= 0)
+                return -1;
+        if (sscanf(buf_.c_str(), "HTTP/%*s %d", &status) != 1)
+            return -1;
+
+        string header = buf_.substr(0, header_end + 2);
+        transform(header.begin(), header.end(), header.begin(), ::tolower);
+        bool closing = header.find("\r\nconnection: close\r\n") != string::npos;
+        size_t pos = header_end + 4;
+
+        size_t cl = header.find("\r\ncontent-length:");
+        if (cl != string::npos) {
+            pos += strtoul(header.c_str() + cl + 17, NULL, 10);
+            if (need(pos) < 0)
+                return -1;
+        } else if (header.find("\r\ntransfer-encoding: chunked\r\n") != string::npos) {
+            for(;;) {
+                size_t end = line_end(pos);
+                if (end == string::npos)
+                    return -1;
+                size_t size = strtoul(buf_.c_str() + pos, NULL, 16);
+                pos = end + 2;
+                if (size == 0) {
+                    /* no trailers expected, just the empty line */
+                    if ((end = line_end(pos)) == string::npos)
+                        return -1;
+                    pos = end + 2;
+                    break;
+                }
+                pos += size + 2;
+                if (need(pos) < 0)
+                    return -1;
+            }
+        } else {
+            while(fill() > 0)
+                ;
+            closing = true;
+            pos = buf_.size();
+        }
+
+        buf_.erase(0, pos);
+        if (closing)
+            disconnect();
+        return 0;
+    }
+};
+
+string video_name(const Config& cfg, size_t i)
+{
+    return "lg" + to_string(cfg.seed) + "_" + to_string(i);
+}
+
+string frames_body(const char *type, const string& name, const vector<uint64_t>& frames)
+{
+    string body = string("{\"type\":\"") + type + "\"";
+    if (!name.empty())
+        body += ",\"name\":\"" + name + "\"";
+    body += ",\"frames\":[";
+    char num[24];
+    for(size_t i = 0; i < frames.size(); i++) {
+        snprintf(num, sizeof(num), i ? ",%llu" : "%llu", (unsigned long long)frames[i]);
+        body += num;
+    }
+    body += "]}";
+    return body;
+}
+
+/* the synthetic workload, the state is per thread */
+class Workload
+{
+public:
+    Workload(const Config& cfg, const vector<vector<uint64_t>>& videos,
+            atomic<size_t>& added, uint64_t seed)
+        : cfg_(cfg), videos_(videos), added_(added), corpus_(seed), weight_sum_(0)
+    {
+        for(int i = 0; i < TYPE_NUM; i++)
+            weight_sum_ += cfg_.mix[i];
+    }
+
+    Request Next()
+    {
+        size_t pick = corpus_.Uniform(weight_sum_);
+        int type = 0;
+        while(pick >= (size_t)cfg_.mix[type])
+            pick -= cfg_.mix[type++];
+
+        Request req;
+        req.type = (ReqType)type;
+        req.post = req.type != QUERYKEY;
+        req.path = "/";
+        size_t src = corpus_.Uniform(videos_.size());
+        if (req.type == ADD) {
+            /* new videos after the preloaded ones */
+            req.body = frames_body("add", video_name(cfg_, added_++), corpus_.Video());
+        } else if (req.type == QUERY) {
+            const auto& frames = videos_[src];
+            vector<uint64_t> query;
+            switch(corpus_.Uniform(3)) {
+                case 0: query = frames; break;
+                case 1: query = corpus_.NearDuplicate(frames, 2, 0.2); break;
+                default: {
+                    size_t len = frames.size() / 5;
+                    vector<uint64_t> host = corpus_.Video();
+                    query = SyntheticCorpus::InsertClip(host, frames, corpus_.Uniform(frames.size() - len),
+                            len, corpus_.Uniform(host.size()));
+                }
+            }
+            req.body = frames_body("query_duplicate", "", query);
+        } else {
+            req.path = "/querykey/" + video_name(cfg_, src);
+        }
+        return req;
+    }
+
+private:
+    const Config& cfg_;
+    const vector<vector<uint64_t>>& videos_;
+    atomic<size_t>& added_;
+    SyntheticCorpus corpus_;
+    size_t weight_sum_;
+};
+
+int load_log(const string& fn, vector<Request>& requests)
+{
+    ifstream in(fn);
+    if (!in) {
+        fprintf(stderr, "Can not open %s\n", fn.c_str());
+        return -1;
+    }
+    string line;
+    while(getline(in, line)) {
+        Request req;
+        size_t path_start;
+        if (line.compare(0, 4, "GET ") == 0) {
+            req.post = false;
+            path_start = 4;
+        } else if (line.compare(0, 5, "POST ") == 0) {
+            req.post = true;
+            path_start = 5;
+        } else {
+            continue;
+        }
+        size_t path_end = line.find(' ', path_start);
+        req.path = line.substr(path_start, path_end == string::npos ? string::npos : path_end - path_start);
+        if (req.post && path_end != string::npos)
+            req.body = line.substr(path_end + 1);
+        req.type = type_of(req.post, req.path, req.body);
+        requests.push_back(std::move(req));
+    }
+    return 0;
+}
+
+void write_log(FILE *fp, const Request& req)
+{
+    if (req.post)
+        fprintf(fp, "POST %s %s\n", req.path.c_str(), req.body.c_str());
+    else
+        fprintf(fp, "GET %s\n", req.path.c_str());
+}
+
+/* add the videos queries are derived from, before the run */
+int preload(const Config& cfg, const vector<vector<uint64_t>>& videos)
+{
+    atomic<size_t> next(0);
+    atomic<size_t> failed(0);
+    vector<thread> threads;
+    for(int t = 0; t < cfg.connections; t++) {
+        threads.push_back(thread([&]() {
+            Connection conn(cfg);
+            size_t i;
+            while((i = next++) < videos.size()) {
+                Request req{ADD, true, "/", frames_body("add", video_name(cfg, i), videos[i])};
+                int status;
+                /* retry when admission is saturated */
+                while((status = conn.Send(req)) == 503)
+                    this_thread::sleep_for(chrono::milliseconds(10));
+                if (status != 200)
+                    failed++;
+            }
+        }));
+    }
+    for(auto& t : threads)
+        t.join();
+    return failed ? -1 : 0;
+}
+
+long percentile(const vector<long>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = min((size_t)(p * sorted.size()), sorted.size() - 1);
+    return sorted[i];
+}
+
+void report(const char *name, vector<long>& latency, size_t errors, size_t busy, double seconds)
+{
+    sort(latency.begin(), latency.end());
+    printf("loadgen %s count=%d errors=%d busy=%d rps=%.1f p50_ms=%.2f p90_ms=%.2f p99_ms=%.2f "
+            "p999_ms=%.2f max_ms=%.2f\n",
+            name, (int)latency.size(), (int)errors, (int)busy, latency.size() / seconds,
+            percentile(latency, 0.5) / 1000.0, percentile(latency, 0.9) / 1000.0,
+            percentile(latency, 0.99) / 1000.0, percentile(latency, 0.999) / 1000.0,
+            latency.empty() ? 0.0 : latency.back() / 1000.0);
+}
+
+int parse_mix(const char *arg, int mix[TYPE_NUM])
+{
+    fill(mix, mix + TYPE_NUM, 0);
+    string s(arg);
+    size_t pos = 0;
+    while(pos < s.size()) {
+        size_t end = s.find(',', pos);
+        string item = s.substr(pos, end == string::npos ? string::npos : end - pos);
+        size_t eq = item.find('=');
+        string key = item.substr(0, eq);
+        int weight = eq == string::npos ? 1 : atoi(item.c_str() + eq + 1);
+        if (key == "add")
+            mix[ADD] = weight;
+        else if (key == "query")
+            mix[QUERY] = weight;
+        else if (key == "querykey")
+            mix[QUERYKEY] = weight;
+        else
+            return -1;
+        pos = end == string::npos ? s.size() : end + 1;
+    }
+    return mix[ADD] + mix[QUERY] + mix[QUERYKEY] > 0 ? 0 : -1;
+}
+
+void print_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "\t-a --addr <host:port> [default 127.0.0.1:8964]\n"
+            "\t-c <connections> [default 8]\n"
+            "\t-d <seconds> [default 10]                      duration of the run\n"
+            "\t-R <requests/s> [default 0]                    open loop at the rate, 0 for closed loop\n"
+            "\t-m <mix> [default add=1,query=8,querykey=1]    weights of the synthetic requests\n"
+            "\t-p <videos> [default 1000]                     synthetic videos added before the run\n"
+            "\t-s <seed> [default 8964]\n"
+            "\t-l <file>                                      send the requests of a log, not synthetic ones\n"
+            "\t-w <file>                                      write the synthetic requests sent, as a log\n",
+            name);
+}
+
+} //end of namespace
+
+int main(int argc, char *argv[])
+{
+    Config cfg;
+    cfg.host = "127.0.0.1";
+    cfg.port = "8964";
+    cfg.connections = 8;
+    cfg.duration_s = 10;
+    cfg.rate = 0;
+    cfg.seed = 8964;
+    cfg.preload = 1000;
+    parse_mix("add=1,query=8,querykey=1", cfg.mix);
+
+    int c;
+    while((c = getopt(argc, argv, "a:c:d:R:m:p:s:l:w:h")) != -1) {
+        switch(c) {
+            case 'a': {
+                string addr(optarg);
+                size_t colon = addr.rfind(':');
+                cfg.host = addr.substr(0, colon);
+                if (colon != string::npos)
+                    cfg.port = addr.substr(colon + 1);
+                break;
+            }
+            case 'c': cfg.connections = max(atoi(optarg), 1); break;
+            case 'd': cfg.duration_s = max(atoi(optarg), 1); break;
+            case 'R': cfg.rate = max(atof(optarg), 0.0); break;
+            case 'm':
+                if (parse_mix(optarg, cfg.mix) < 0) {
+                    fprintf(stderr, "Bad mix: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p': cfg.preload = max(atoi(optarg), 1); break;
+            case 's': cfg.seed = strtoull(optarg, NULL, 10); break;
+            case 'l': cfg.log_file = optarg; break;
+            case 'w': cfg.write_file = optarg; break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    vector<Request> logged;
+    vector<vector<uint64_t>> videos;
+    if (!cfg.log_file.empty()) {
+        if (load_log(cfg.log_file, logged) < 0 || logged.empty()) {
+            fprintf(stderr, "No requests in %s\n", cfg.log_file.c_str());
+            return 1;
+        }
+    } else {
+        SyntheticCorpus corpus(cfg.seed);
+        for(size_t i = 0; i < cfg.preload; i++)
+            videos.push_back(corpus.Video());
+        TimeCounter tc;
+        if (preload(cfg, videos) < 0) {
+            fprintf(stderr, "Preload failed, is the server at %s:%s?\n", cfg.host.c_str(), cfg.port.c_str());
+            return 1;
+        }
+        fprintf(stderr, "Preloaded %d videos in %.1f s\n", (int)videos.size(), tc.GetTimeMilliS() / 1000.0);
+    }
+
+    FILE *log_fp = nullptr;
+    mutex log_mutex;
+    if (!cfg.write_file.empty() && cfg.log_file.empty()
+            && (log_fp = fopen(cfg.write_file.c_str(), "w")) == nullptr) {
+        perror(cfg.write_file.c_str());
+        return 1;
+    }
+
+    atomic<size_t> next(0);
+    atomic<size_t> added(cfg.preload);
+    vector<Stat> stats(cfg.connections);
+    vector<thread> threads;
+    long start_us = TimeCounter::NowMicroS();
+    long end_us = start_us + cfg.duration_s * 1000000L;
+
+    for(int t = 0; t < cfg.connections; t++) {
+        threads.push_back(thread([&, t]() {
+            Connection conn(cfg);
+            Workload workload(cfg, videos, added, cfg.seed + 1 + t);
+            Stat& stat = stats[t];
+            for(;;) {
+                size_t k = next++;
+                /* open loop: request k is due at its time, late or not */
+                long due_us = cfg.rate > 0 ? start_us + (long)(k * 1000000.0 / cfg.rate)
+                    : TimeCounter::NowMicroS();
+                if (due_us >= end_us)
+                    break;
+                Request req = logged.empty() ? workload.Next() : logged[k % logged.size()];
+                if (log_fp) {
+                    lock_guard<mutex> lock(log_mutex);
+                    write_log(log_fp, req);
+                }
+                long wait_us = due_us - TimeCounter::NowMicroS();
+                if (wait_us > 0)
+                    this_thread::sleep_for(chrono::microseconds(wait_us));
+
+                int status = conn.Send(req);
+                stat.latency_us[req.type].push_back(TimeCounter::NowMicroS() - due_us);
+                if (status != 200) {
+                    stat.errors[req.type]++;
+                    if (status == 503)
+                        stat.busy[req.type]++;
+                    if (status < 0)
+                        stat.io_errors++;
+                }
+            }
+        }));
+    }
+    for(auto& t : threads)
+        t.join();
+    double seconds = (TimeCounter::NowMicroS() - start_us) / 1000000.0;
+    if (log_fp)
+        fclose(log_fp);
+
+    printf("loadgen_config - mode=%s connections=%d duration_s=%d rate=%.1f source=%s seed=%llu preload=%d\n",
+            cfg.rate > 0 ? "open" : "closed", cfg.connections, cfg.duration_s, cfg.rate,
+            cfg.log_file.empty() ? "synthetic" : cfg.log_file.c_str(),
+            (unsigned long long)cfg.seed, (int)videos.size());
+
+    vector<long> all;
+    size_t all_errors = 0, all_busy = 0, io_errors = 0;
+    for(int type = 0; type < TYPE_NUM; type++) {
+        vector<long> latency;
+        size_t errors = 0, busy = 0;
+        for(auto& stat : stats) {
+            latency.insert(latency.end(), stat.latency_us[type].begin(), stat.latency_us[type].end());
+            errors += stat.errors[type];
+            busy += stat.busy[type];
+        }
+        all.insert(all.end(), latency.begin(), latency.end());
+        all_errors += errors;
+        all_busy += busy;
+        if (!latency.empty())
+            report(TYPE_NAMES[type], latency, errors, busy, seconds);
+    }
+    for(auto& stat : stats)
+        io_errors += stat.io_errors;
+    report("all", all, all_errors, all_busy, seconds);
+    if (io_errors)
+        fprintf(stderr, "%d requests failed on the connection\n", (int)io_errors);
+    return 0;
+}
+
@@ -1,7 +1,11 @@
 #include <http_server.hpp>
+#include <Capture.hpp>
 #include <VideoDB.hpp>
 #include <Log.hpp>
 #include <RequestProcessor.hpp>
+#include <SlowLog.hpp>
+#include <StatMutex.hpp>
+#include <Trace.hpp>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
@@ -15,17 +19,87 @@ namespace {
 
 using namespace tws;
 
+#ifdef HTTP_COMPRESSION
+/* replies smaller than it are not worth compressing */
+const size_t COMPRESS_MIN_SIZE = 1024;
+const int COMPRESS_LEVEL = 1;
+
+bool accept_gzip(const Request& req)
+{
+    for(const auto& h : req.headers()) {
+        if (strcasecmp(h.first.c_str(), "Accept-Encoding") == 0
+                && strstr(h.second.c_str(), "gzip") != nullptr)
+            return true;
+    }
+    return false;
+}
+#endif
+
+int hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+std::string url_decode(const char *s, size_t len)
+{
+    std::string out;
+    for(size_t i = 0; i < len; i++) {
+        if (s[i] == '+') {
+            out.push_back(' ');
+        } else if (s[i] == '%' && i + 2 < len
+                && hex_value(s[i + 1]) >= 0 && hex_value(s[i + 2]) >= 0) {
+            out.push_back((char)(hex_value(s[i + 1]) * 16 + hex_value(s[i + 2])));
+            i += 2;
+        } else {
+            out.push_back(s[i]);
+        }
+    }
+    return out;
+}
+
+/* split "/path?a=1&b=2" into the path and its args */
+std::string split_query(const std::string& full, VideoMatch::ArgMap& args)
+{
+    size_t q = full.find('?');
+    if (q == std::string::npos)
+        return full;
+
+    const char *s = full.c_str() + q + 1;
+    while(*s) {
+        const char *e = strchr(s, '&');
+        size_t len = e ? e - s : strlen(s);
+        const char *eq = (const char *)memchr(s, '=', len);
+        if (eq)
+            args[url_decode(s, eq - s)] = url_decode(eq + 1, s + len - eq - 1);
+        else if (len)
+            args[url_decode(s, len)] = "";
+        s += e ? len + 1 : len;
+    }
+    return full.substr(0, q);
+}
+
 int my_handler(Response& resp, const Request& req)
 {
     using VideoMatch::RequestProcessor;
+    using VideoMatch::Admission;
     std::string body;
+    const char *content_type = "text/html";
     
     /* 
        support operation:
        GET /info
+       GET /metrics
+       GET /trace
+       GET /slowqueries
+       GET /index_stats
+       GET /memory
+       GET /profile[?seconds=N&hz=F]
        GET /save
        GET /exit
-       GET /querykey/$key
+       GET /querykey/$key[?limit=N&min_score=S&fields=name,score&deadline_ms=T&trace=true]
        POST json to add/query by frames
     */
     auto prefixeq = [](const std::string& base, const std::string& match) {
@@ -34,48 +108,112 @@ int my_handler(Response& resp, const Request& req)
             return true;
         return false;
     };
+
+    /* admit a request before switching it into thread pool,
+       fail fast if its class is saturated */
+    auto admit = [&](Admission::Lane lane, long units) {
+        int retry_after;
+        if (Admission::Enter(&req, lane, units, retry_after))
+            return HTTP_SWITCH_THREAD;
+        resp.set_body("{\"code\":-1,\"msg\":\"Server busy\"}");
+        resp.set_header("Server", "Video Match Server 1.0");
+        resp.set_header("Retry-After", (long)retry_after);
+        return HTTP_503;
+    };
  
     if (req.type() == HTTP_GET) {
+        bool profile = req.path() == "/profile" || prefixeq(req.path(), "/profile?");
         if (req.path() == "/info") {
             /* Show DB info, need not in thread pool */
             RequestProcessor::Info(body);
+        } else if (req.path() == "/metrics") {
+            /* for Prometheus scrapers, need not in thread pool */
+            RequestProcessor::Scrape(body);
+            content_type = "text/plain; version=0.0.4";
+        } else if (req.path() == "/trace") {
+            /* traces of recent requests, for chrome://tracing or Perfetto */
+            RequestProcessor::DumpTrace(body);
+            content_type = "application/json";
+        } else if (req.path() == "/slowqueries") {
+            RequestProcessor::SlowQueries(body);
+            content_type = "application/json";
         } else if (req.path() == "/exit") {
             exit(0);
         } else if (req.path() == "/save" 
+                || req.path() == "/index_stats"
+                || req.path() == "/memory"
+                || profile
                 || prefixeq(req.path(), "/querykeyplain/")
                 || prefixeq(req.path(), "/querykey/")) {
-            if (!req.in_threadpool()) 
-                return HTTP_SWITCH_THREAD;
+            if (!req.in_threadpool()) {
+                /* plain queries are made by batch scripts */
+                if (req.path() == "/save" || req.path() == "/index_stats"
+                        || req.path() == "/memory" || profile)
+                    return admit(Admission::ADMIN, 1);
+                if (prefixeq(req.path(), "/querykeyplain/"))
+                    return admit(Admission::BULK, RequestProcessor::EstimateQueryKey());
+                return admit(Admission::INTERACTIVE, RequestProcessor::EstimateQueryKey());
+            }
 
+            Admission::Ticket ticket(&req);
             if (req.path() == "/save") {
                 RequestProcessor::SaveDB();
                 body = "Done\n";
+            } else if (req.path() == "/index_stats") {
+                /* scans the hot slots under the lock, not in the network thread */
+                RequestProcessor::IndexStats(body);
+                content_type = "application/json";
+            } else if (req.path() == "/memory") {
+                RequestProcessor::Memory(body);
+                content_type = "application/json";
+            } else if (profile) {
+                /* sleeps while sampling, holding the admin lane */
+                VideoMatch::ArgMap args;
+                split_query(req.path(), args);
+                RequestProcessor::Profile(args, body);
+                content_type = "text/plain";
             } else if (prefixeq(req.path(), "/querykey/")) {
-                std::string key = req.path().substr(strlen("/querykey/"));
-                RequestProcessor::Query(key, body, false);
+                VideoMatch::ArgMap args;
+                std::string key = split_query(req.path(), args).substr(strlen("/querykey/"));
+                RequestProcessor::Query(key, args, body, false, ticket.EnterMicroS());
             } else if (prefixeq(req.path(), "/querykeyplain/")) {
-                std::string key = req.path().substr(strlen("/querykeyplain/"));
-                RequestProcessor::Query(key, body, true);
+                VideoMatch::ArgMap args;
+                std::string key = split_query(req.path(), args).substr(strlen("/querykeyplain/"));
+                RequestProcessor::Query(key, args, body, true, ticket.EnterMicroS());
             }
         } else {
             /* show help info */
             body = "Command:\r\n"
                 "GET /exit\r\n"
                 "GET /info\r\n"
+                "GET /metrics\r\n"
+                "GET /trace\r\n"
+                "GET /slowqueries\r\n"
+                "GET /index_stats\r\n"
+                "GET /memory\r\n"
+                "GET /profile[?seconds=N&hz=F]\r\n"
                 "GET /save\r\n"
-                "GET /querykey/$key\r\n";
+                "GET /querykey/$key[?limit=N&min_score=S&fields=name,score&deadline_ms=T&trace=true]\r\n";
         }
     } else if (req.type() == HTTP_POST) {
-        if (!req.in_threadpool()) 
-            return HTTP_SWITCH_THREAD;
+        if (!req.in_threadpool()) {
+            long units;
+            Admission::Lane lane = RequestProcessor::Estimate(req.postdata(), units);
+            return admit(lane, units);
+        }
 
         /* all requests about match engine should be processed in thread pool */
-        RequestProcessor::Process(req.postdata(), body);
+        Admission::Ticket ticket(&req);
+        RequestProcessor::Process(req.postdata(), body, ticket.EnterMicroS());
     }
 
+#ifdef HTTP_COMPRESSION
+    if (body.size() >= COMPRESS_MIN_SIZE && accept_gzip(req))
+        resp.set_compression(COMPRESS_LEVEL);
+#endif
     resp.set_body(body);
     resp.set_header("Server", "Video Match Server 1.0");
-    resp.set_header("Content-Type", "text/html");
+    resp.set_header("Content-Type", content_type);
     return HTTP_200;
 }
 
@@ -87,18 +225,94 @@ void print_usage(const char *sexec)
            "\t-d --dir <path> [default ./]                  the db file load/save directory\n"
            "\t-l --log-file <filename> [default time.txt]   the log file name\n"
            "\t-L --log-level <level> [default info]         the log level, one in [debug|info|error]\n"
+           "\t-R --log-rotate <MB>[:<files>] [default 0:5]   rotate the log file when above MB (0 never),\n"
+           "\t                                               keeping that many old files\n"
+           "\t-t --threads <num> [default 4]                 max requests processed at the same time\n"
+           "\t-W --lane <lane>:<num>[:<weight>]              max requests of a lane in [interactive|bulk|ingest|admin]\n"
+           "\t                                               processed at the same time, and its share of workers,\n"
+           "\t                                               default interactive:<threads>:8 bulk:<threads/4>:2\n"
+           "\t                                               ingest:<threads/4>:2 admin:1:1, lanes left at\n"
+           "\t                                               their default leave one thread to interactive\n"
+           "\t-Q --queue <lane>:<num>[:<ms>]                 max queued requests of a lane,\n"
+           "\t                                               and max estimated queued work in ms (0 no limit),\n"
+           "\t                                               default interactive:32:5000 bulk:16:60000 ingest:32:0 admin:2:0\n"
+           "\t-B --bulk-frames <num> [default 3000]          queries of more frames go to the bulk lane\n"
+           "\t-D --deadline-ms <ms> [default 30000]          deadline of queries since arrival, 0 for none,\n"
+           "\t                                               queries may set their own by 'deadline_ms'\n"
+           "\t-S --slow-ms <ms> [default 1000]               keep queries slower than it for GET /slowqueries, 0 for none\n"
+           "\t-K --lock-log-ms <ms> [default 0]              log holders of the VideoDB lock longer than it, 0 for none\n"
+           "\t-T --trace-sample <N> [default 0]              trace one of every N requests, 0 for none,\n"
+           "\t                                               requests may ask for it by 'trace', see GET /trace\n"
+           "\t   --capture-file <filename>                   capture add and query requests for 'replay'\n"
+           "\t   --capture-sample <N> [default 1]            capture one of every N requests\n"
+           "\t   --capture-rotate <MB>[:<files>] [default 64:5] rotate the capture file when above MB (0 never),\n"
+           "\t                                               keeping that many old files\n"
           , sexec);
 }
 
+/* find lane by name, -1 if not found */
+int lane_by_name(const char *name)
+{
+    using VideoMatch::Admission;
+    for(int i = 0; i < Admission::LANE_NUM; i++) {
+        if (strcasecmp(name, Admission::LaneName((Admission::Lane)i)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* parse "<lane>:<num>[:<ms>]" of --queue */
+int set_queue_limit(const char *arg)
+{
+    using VideoMatch::Admission;
+    char name[16];
+    int max_queued;
+    long max_queued_ms = 0;
+    if (sscanf(arg, "%15[^:]:%d:%ld", name, &max_queued, &max_queued_ms) < 2
+            || max_queued < 0 || max_queued_ms < 0 || lane_by_name(name) < 0)
+        return -1;
+    Admission::SetQueueLimit((Admission::Lane)lane_by_name(name), max_queued, max_queued_ms);
+    return 0;
+}
+
+/* parse "<lane>:<num>[:<weight>]" of --lane */
+int set_lane_workers(const char *arg)
+{
+    using VideoMatch::Admission;
+    char name[16];
+    int workers;
+    int weight = 0;
+    if (sscanf(arg, "%15[^:]:%d:%d", name, &workers, &weight) < 2
+            || workers <= 0 || weight < 0 || lane_by_name(name) < 0)
+        return -1;
+    Admission::SetLaneWorkers((Admission::Lane)lane_by_name(name), workers, weight);
+    return 0;
+}
+
+/* options with no short name */
+enum {
+    OPT_CAPTURE_FILE = 256,
+    OPT_CAPTURE_SAMPLE,
+    OPT_CAPTURE_ROTATE,
+};
+
 } //end of namespace
 
 int main(int argc, char *argv[])
 {
     const char *dir = "./";
     int port = 8964;
+    int threads = 4;
+    long deadline_ms = 30000;
     char default_log_file[255];
     char *log_file = default_log_file;
     LOG_LEVEL log_level = LINFO;
+    long log_rotate_mb = 0;
+    int log_rotate_files = 5;
+    const char *capture_file = nullptr;
+    int capture_sample = 1;
+    long capture_rotate_mb = 64;
+    int capture_rotate_files = 5;
 
     snprintf(default_log_file, 255, "./%ld.log", time(NULL));
     static struct option long_options[] = {
@@ -106,12 +320,24 @@ int main(int argc, char *argv[])
         {"port",     required_argument, 0,  'p' },
         {"log-file",     required_argument, 0,  'l' },
         {"log-level",     required_argument, 0,  'L' },
+        {"log-rotate",     required_argument, 0,  'R' },
+        {"threads",     required_argument, 0,  't' },
+        {"queue",     required_argument, 0,  'Q' },
+        {"lane",     required_argument, 0,  'W' },
+        {"bulk-frames",     required_argument, 0,  'B' },
+        {"deadline-ms",     required_argument, 0,  'D' },
+        {"slow-ms",     required_argument, 0,  'S' },
+        {"trace-sample",     required_argument, 0,  'T' },
+        {"lock-log-ms",     required_argument, 0,  'K' },
+        {"capture-file",     required_argument, 0,  OPT_CAPTURE_FILE },
+        {"capture-sample",     required_argument, 0,  OPT_CAPTURE_SAMPLE },
+        {"capture-rotate",     required_argument, 0,  OPT_CAPTURE_ROTATE },
         {      0,     0,     0,     0},  
     };
 
     int long_index = 0;
     int opt;
-    while((opt = getopt_long(argc, argv, "d:p:l:L:", long_options, &long_index)) != -1) {
+    while((opt = getopt_long(argc, argv, "d:p:l:L:R:t:Q:W:B:D:S:T:K:", long_options, &long_index)) != -1) {
         switch(opt) {
             case 'd':
                 dir = optarg;
@@ -130,6 +356,64 @@ int main(int argc, char *argv[])
                 else if (strcasecmp(optarg,"ERROR") == 0)
                     log_level = LERROR;
                 break;
+            case 'R':
+                if (sscanf(optarg, "%ld:%d", &log_rotate_mb, &log_rotate_files) < 1
+                        || log_rotate_mb < 0 || log_rotate_files < 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads <= 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'Q':
+                if (set_queue_limit(optarg) < 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'W':
+                if (set_lane_workers(optarg) < 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'B':
+                VideoMatch::RequestProcessor::SetBulkFrames(atol(optarg));
+                break;
+            case 'D':
+                deadline_ms = atol(optarg);
+                break;
+            case 'S':
+                VideoMatch::SlowLog::SetThreshold(atol(optarg));
+                break;
+            case 'K':
+                VideoMatch::StatMutex::SetHoldLogThreshold(atol(optarg));
+                break;
+            case 'T':
+                VideoMatch::Trace::SetSampleRate(atoi(optarg));
+                break;
+            case OPT_CAPTURE_FILE:
+                capture_file = optarg;
+                break;
+            case OPT_CAPTURE_SAMPLE:
+                capture_sample = atoi(optarg);
+                if (capture_sample <= 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_CAPTURE_ROTATE:
+                if (sscanf(optarg, "%ld:%d", &capture_rotate_mb, &capture_rotate_files) < 1
+                        || capture_rotate_mb < 0 || capture_rotate_files < 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
@@ -137,13 +421,21 @@ int main(int argc, char *argv[])
         }
     }
 
+    LogSetRotation(log_rotate_mb << 20, log_rotate_files);
     LogInit(log_file, log_level);
+    if (capture_file && VideoMatch::Capture::Open(capture_file, capture_sample,
+                capture_rotate_mb << 20, capture_rotate_files) < 0)
+        return 1;
 
     VideoMatch::VideoDB video_db(dir);
     video_db.Load();
 
     VideoMatch::RequestProcessor::SetVideoDB(&video_db);
-    tws::HttpServer http_server(port, &my_handler, 4);
+    VideoMatch::RequestProcessor::SetDefaultDeadline(deadline_ms);
+    /* every admitted request gets a thread of the pool, 
+       then waits for being scheduled by its lane */
+    VideoMatch::Admission::SetWorkers(threads);
+    tws::HttpServer http_server(port, &my_handler, VideoMatch::Admission::PoolThreads());
     http_server.run();
 
     return 0;
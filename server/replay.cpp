@@ -0,0 +1,213 @@
+#include <Capture.hpp>
+#include <VideoDB.hpp>
+#include <TimeCounter.hpp>
+#include <Log.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+/*
+   Replay of captured requests (server --capture-file) against an
+   in-process VideoDB, run by 'make replay && ./replay'.
+       ./replay [-d db_dir] [-x speed] [-t threads] [-o out] capture ...
+   The db snapshot of db_dir is loaded, then the records of all the capture
+   files, in time order, are sent to -t threads at their original times
+   divided by 'speed' (0 as fast as the threads go). Latency counts from when
+   a request is due, so a slower engine shows as queueing, as in production.
+   -o writes one line per request:
+       <seq> <type> <frames> <candidates> <results> <service_us> <latency_us>
+   Each summary is one line, as bench's:
+       replay <type> <key>=<value> ...
+*/
+
+using namespace std;
+using namespace VideoMatch;
+
+
+namespace {
+
+struct Result
+{
+    size_t candidates;
+    size_t results;
+    long service_us;
+    long latency_us;
+};
+
+long percentile(const vector<long>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[min((size_t)(p * sorted.size()), sorted.size() - 1)];
+}
+
+/* as RequestProcessor does, without json */
+void execute(VideoDB& db, const Capture::Record& record, long due_us, Result& result)
+{
+    VideoDB::QueryParam param = record.param;
+    if (record.deadline_ms)
+        param.deadline_us = due_us + record.deadline_ms * 1000;
+    VideoDB::QueryStat stat;
+    vector<pair<string, double>> matched;
+
+    if (record.type == Capture::ADD) {
+        db.Add(VideoDB::DataItem(record.name, vector<uint64_t>(record.frames)));
+    } else if (record.type == Capture::QUERY) {
+        db.Query(VideoDB::DataItem("QUERY", vector<uint64_t>(record.frames)), param, matched, &stat);
+    } else {
+        VideoDB::DataItem data_item("");
+        if (db.Query(record.name, data_item) == 0)
+            db.Query(data_item, param, matched, &stat);
+    }
+    result.candidates = stat.candidates;
+    result.results = matched.size();
+}
+
+void print_usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d db_dir] [-x speed] [-t threads] [-o out] capture ...\n"
+            "\t-d <path>                  load the db snapshot of the directory first\n"
+            "\t-x <speed> [default 1]     times as fast as captured, 0 for as fast as possible\n"
+            "\t-t <threads> [default 4]   requests processed at the same time\n"
+            "\t-o <file>                  write the latency of each request\n",
+            name);
+}
+
+} //end of namespace
+
+int main(int argc, char *argv[])
+{
+    const char *dir = nullptr;
+    const char *out_file = nullptr;
+    double speed = 1.0;
+    int threads = 4;
+
+    int c;
+    while((c = getopt(argc, argv, "d:x:t:o:h")) != -1) {
+        switch(c) {
+            case 'd': dir = optarg; break;
+            case 'x': speed = max(atof(optarg), 0.0); break;
+            case 't': threads = max(atoi(optarg), 1); break;
+            case 'o': out_file = optarg; break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* Add() logs every video */
+    g_log_level = LERROR;
+
+    vector<Capture::Record> records;
+    for(int i = optind; i < argc; i++) {
+        Capture::Reader reader;
+        if (reader.Open(argv[i]) < 0) {
+            fprintf(stderr, "%s is not a capture file\n", argv[i]);
+            return 1;
+        }
+        /* files of other runs are on other monotonic clocks, wall time
+           orders them */
+        long to_unix_us = reader.StartUnixMicroS() - reader.StartMonoMicroS();
+        Capture::Record record;
+        int ret, count = 0;
+        while((ret = reader.Next(record)) > 0) {
+            record.time_us += to_unix_us;
+            records.push_back(record);
+            count++;
+        }
+        /* the last record of a server killed while writing */
+        if (ret < 0)
+            fprintf(stderr, "%s is truncated after %d records\n", argv[i], count);
+    }
+    if (records.empty()) {
+        fprintf(stderr, "No records\n");
+        return 1;
+    }
+    /* writers race for the file, and rotated files come in any order */
+    stable_sort(records.begin(), records.end(),
+            [](const Capture::Record& r1, const Capture::Record& r2) {
+                return r1.time_us < r2.time_us;
+            });
+
+    VideoDB db(dir ? dir : "");
+    if (dir) {
+        TimeCounter tc;
+        if (db.Load() < 0)
+            return 1;
+        fprintf(stderr, "Loaded %d videos in %.1f s\n", db.Count(), tc.GetTimeMilliS() / 1000.0);
+    }
+
+    vector<Result> results(records.size());
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    long first_us = records.front().time_us;
+    long start_us = TimeCounter::NowMicroS();
+    for(int t = 0; t < threads; t++) {
+        workers.push_back(thread([&]() {
+            size_t i;
+            while((i = next++) < records.size()) {
+                long due_us = speed > 0 ? start_us + (long)((records[i].time_us - first_us) / speed)
+                    : TimeCounter::NowMicroS();
+                long wait_us = due_us - TimeCounter::NowMicroS();
+                if (wait_us > 0)
+                    this_thread::sleep_for(chrono::microseconds(wait_us));
+                long begin_us = TimeCounter::NowMicroS();
+                execute(db, records[i], due_us, results[i]);
+                long end_us = TimeCounter::NowMicroS();
+                results[i].service_us = end_us - begin_us;
+                results[i].latency_us = end_us - due_us;
+            }
+        }));
+    }
+    for(auto& t : workers)
+        t.join();
+    double seconds = (TimeCounter::NowMicroS() - start_us) / 1000000.0;
+    double captured_seconds = (records.back().time_us - first_us) / 1000000.0;
+
+    if (out_file) {
+        FILE *fp = fopen(out_file, "w");
+        if (fp == nullptr) {
+            perror(out_file);
+            return 1;
+        }
+        for(size_t i = 0; i < records.size(); i++)
+            fprintf(fp, "%d %s %d %d %d %ld %ld\n", (int)i, Capture::TypeName(records[i].type),
+                    (int)records[i].frames.size(), (int)results[i].candidates, (int)results[i].results,
+                    results[i].service_us, results[i].latency_us);
+        fclose(fp);
+    }
+
+    printf("replay_config - records=%d captured_s=%.1f speed=%.2f threads=%d videos=%d\n",
+            (int)records.size(), captured_seconds, speed, threads, db.Count());
+    for(int type = 0; type <= Capture::TYPE_NUM; type++) {
+        vector<long> latency, service;
+        for(size_t i = 0; i < records.size(); i++) {
+            if (type < Capture::TYPE_NUM && records[i].type != type)
+                continue;
+            latency.push_back(results[i].latency_us);
+            service.push_back(results[i].service_us);
+        }
+        if (latency.empty())
+            continue;
+        sort(latency.begin(), latency.end());
+        sort(service.begin(), service.end());
+        printf("replay %s count=%d rps=%.1f p50_ms=%.2f p90_ms=%.2f p99_ms=%.2f max_ms=%.2f "
+                "service_p50_ms=%.2f service_p99_ms=%.2f\n",
+                type < Capture::TYPE_NUM ? Capture::TypeName((Capture::Type)type) : "all",
+                (int)latency.size(), latency.size() / seconds,
+                percentile(latency, 0.5) / 1000.0, percentile(latency, 0.9) / 1000.0,
+                percentile(latency, 0.99) / 1000.0, latency.back() / 1000.0,
+                percentile(service, 0.5) / 1000.0, percentile(service, 0.99) / 1000.0);
+    }
+    return 0;
+}
+